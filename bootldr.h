@@ -0,0 +1,83 @@
+/*
+ * Initially developed at Ghent University as part of a masters thesis promoted
+ * by prof. dr. ir. Bjorn De Sutter of the Computer Systems Lab in cooperation with ir. Daan Raman from NVISO.
+ * Description: Format of the Android bootloader.img, shared by bootloader_unpacker and imgdata
+ * Usage: bootldr_find() looks up an image by name in a bootloader.img in memory, so its
+ *        contents can be used where they are without unpacking them first
+ */
+
+#ifndef BOOTLDR_H
+#define BOOTLDR_H
+
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "lecodec.h"
+
+/* from AOSP device/lge/hammerhead/releasetools.py ("<8sIII" and "<64sI") */
+/* unsigned int are in little endian, see lecodec.h */
+
+#define BOOTLDR_MAGIC "BOOTLDR!"
+#define BOOTLDR_MAGIC_SIZE 8 /* No room for terminating \0 */
+#define BOOTLDR_MAX_IMAGES 1024 /* more images than this is taken as a broken header, the LG Nexus 5 has 6 */
+
+#define BOOTLDRIMGH_FIELDS(U32, BYTES) \
+	BYTES(magic, BOOTLDR_MAGIC_SIZE) \
+	U32(num_images) \
+	U32(start_offset) \
+	U32(bootldr_size)
+
+#define IMG_INFO_FIELDS(U32, BYTES) \
+	BYTES(name, 64) \
+	U32(size)
+
+typedef struct {
+	LECODEC_STRUCT(BOOTLDRIMGH_FIELDS)
+} bootldrimgh;
+
+typedef struct {
+	LECODEC_STRUCT(IMG_INFO_FIELDS)
+} img_info;
+
+LECODEC(bootldrimgh, BOOTLDRIMGH_FIELDS)
+LECODEC(img_info, IMG_INFO_FIELDS)
+
+/*
+ * Looks up the image called name in the len bytes of a bootloader.img at buf
+ * Images are stored back to back from start_offset, so only the table up to it is decoded
+ * Returns EXIT_FAILURE if buf is no bootloader.img, has no such image or it ends past len
+ */
+static inline int bootldr_find(const unsigned char *buf, size_t len, const char *name, size_t *offset, size_t *size) {
+	bootldrimgh bimg;
+	img_info info;
+	unsigned long long start;
+	size_t n = strlen(name);
+	unsigned int i;
+
+	if (len < bootldrimgh_size || n > sizeof(info.name)) {
+		return EXIT_FAILURE;
+	}
+	bootldrimgh_decode(&bimg, buf);
+	if (strncmp(bimg.magic, BOOTLDR_MAGIC, BOOTLDR_MAGIC_SIZE) || bimg.num_images > BOOTLDR_MAX_IMAGES ||
+			bimg.start_offset < bootldrimgh_size + bimg.num_images * img_info_size || bimg.start_offset > len) {
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0, start = bimg.start_offset; i < bimg.num_images; ++i, start += info.size) {
+		img_info_decode(&info, buf + bootldrimgh_size + i * img_info_size);
+		/* name in the table is not guaranteed to be terminated */
+		if (!strncmp(info.name, name, n) && (n == sizeof(info.name) || info.name[n] == '\0')) {
+			if (start + info.size > len) {
+				return EXIT_FAILURE;
+			}
+			*offset = start;
+			*size = info.size;
+			return EXIT_SUCCESS;
+		}
+	}
+
+	return EXIT_FAILURE;
+}
+
+#endif
@@ -5,7 +5,7 @@
 # Version: 20140220
 # Description: Unpacks the bootloader.img and adds zeroes to the extracted
 #              images to have the same size as their corresponding partitions.
-# Instructions: compile bootldr_unpacker: gcc bootloader_unpacker.c -o bunp
+# Instructions: compile bootldr_unpacker: gcc bootloader_unpacker.c -o bunp -lpthread
 #
 ### CONFIG BEGIN ###
 bunp="./bunp"
@@ -22,15 +22,8 @@ imgdata:3145728
 ### CONFIG END ###
 
 [[ ! -f "$1" ]] && echo "Usage: $0 <bootloader.img>" && exit 2
-[[ ! -f "$bunp" ]] && gcc bootloader_unpacker.c -o bunp
+[[ ! -f "$bunp" ]] && gcc bootloader_unpacker.c -o bunp -lpthread
 
 # Unpack with own unpacker, gives partition names on a new line
-parts="$("$bunp" "$1")"
-
-# Add zeroes according to ptable
-for part in $parts; do
-  psize=$(stat -c %s "$part.img")
-  tsize=$(echo "$ptable" | sed -n "s/^$part://p")
-  towrite=$(($tsize - $psize))
-  dd status=noxfer if=/dev/zero of="$part.img" seek=$psize obs=1 ibs=$towrite count=1 2>/dev/null
-done
+# and pads every image up to its size in ptable
+"$bunp" -p "$ptable" "$1"
@@ -4,99 +4,2340 @@
  * Author: Christophe Beauval
  * Version: 20140302
  * Description: Unpacks the Android bootloader.img
+ * Instructions: gcc bootloader_unpacker.c -o bunp -lpthread
+ * Usage: $0 [-v] [-s] [-t] [-j N] [-d <store>] [-p <ptable>] [-P <file>] <bootloader.img|->
+ *        $0 -b [-s] [-j N] [-d <store>] [-p <ptable>] [-P <file>] [-o <dir>] [-f <list>] [<bootloader.img> ...]
+ *        $0 -V <dumpdir> [-v] <bootloader.img>
+ *        $0 -J [-j N] [-f <list>] [<bootloader.img|imgdata.img> ...]
+ *        $0 -D <patch> [-v] <old.img> <new.img>
+ *        $0 -A <patch> <old.img|partition> <new.img>
+ *           -v : verbose, print header info and every unpacked image
+ *           -s : read the input as a stream instead of mapping it, - reads from stdin
+ *           -t : print bytes copied through user space buffers and wall time to stderr
+ *           -j N : unpack up to N images (or with -b: N files) at the same time
+ *           -b : batch mode, unpack every given file into <dir>/<file basename without .img>/
+ *           -o <dir> : base output dir for -b, default is the working dir
+ *           -f <list> : read files for -b or -J from <list>, one per line, - for stdin
+ *           -J : index mode, write a JSON line per file with its images (or imgdata contents) to stdout,
+ *                only headers are read, files/s goes to stderr
+ *           -d <store> : store every image once in <store>/<sha256[0:2]>/<sha256[2:]> and only
+ *                        write a manifest.txt with name, size and sha256 per image
+ *           -p <ptable> : pad every <name>.img with zeroes up to its partition size, <ptable> is
+ *                         a list of name:size separated by commas, spaces or newlines
+ *           -P <file> : as -p, with every name:size line in <file> (like extras/etc/hammerhead.conf)
+ *           -V <dumpdir> : write nothing, compare every image with <dumpdir>/<name>.img (or <name>),
+ *                          a dump of its partition, trailing zeroes don't count as a difference
+ *           -D <patch> : write what changed from <old.img> to <new.img> to <patch>, two bootloader.img are compared
+ *                        image by image, two imgdata.img (also inside a bootloader.img) content by content and
+ *                        pixelrun by pixelrun, anything else block by block
+ *           -A <patch> : rebuild <new.img> from <old.img> (or the partition holding it) and <patch>, it is
+ *                        only kept when its SHA-256 is the one <patch> was made for
  */
 
+#define _GNU_SOURCE /* copy_file_range */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <pthread.h>
+
+#include "bootldr.h"
+#include "imgdata.h" /* only the format, for -J */
+
+#define STREAM_BUFFER_SIZE 65536 /* bytes read at once when not mapped */
+#define SHA256_HEX_SIZE 65 /* 64 hex digits and \0 */
+#define MAX_JOBS 1024 /* threads at most for -j */
+#define MANIFEST_NAME "manifest.txt" /* written instead of the images with -d */
+#define VERIFY_BLOCK_SIZE 65536 /* bytes compared at once by -V, only a differing block is searched bytewise */
+#define PATCH_MAGIC "BLDRDIFF"
+#define PATCH_MAGIC_SIZE 8
+#define PATCH_VERSION 1
+#define PATCH_BLOCK_SIZE 4096 /* granularity of -D outside imgdata contents, a changed block goes in whole */
+#define PATCH_MAX_SIZE 0xffffffffULL /* sizes and offsets in a patch are 32bit */
+
+/* ops of a -D patch, each makes the next len bytes of the new image */
+#define PATCH_COPY 0 /* copied from offset in the old image */
+#define PATCH_DATA 1 /* the len bytes following the op, offset is where they go in the new image */
+#define PATCH_ZERO 2 /* zeroes, padding mostly */
 
-/* from AOSP device/lge/hammerhead/releasetools.py */
-/* unsigned int are in big endian */
+/* how the images of a -D patch were compared */
+#define PATCH_KIND_BLOCKS 0 /* block by block, any file */
+#define PATCH_KIND_BOOTLDR 1 /* image by image, matched by name */
+#define PATCH_KIND_IMGDATA 2 /* content by content, matched by name and diffed by pixelrun */
 
-#define BOOTLDR_MAGIC "BOOTLDR!"
-#define BOOTLDR_MAGIC_SIZE 8 /* No room for terminating \0 */
+/* counters for -t and -b */
+typedef struct {
+	unsigned long long copied; /* bytes that passed through a user space buffer */
+	unsigned long long written; /* bytes that ended up in output files */
+	unsigned long long deduped; /* bytes of images already in the -d store */
+	double checked; /* seconds spent parsing and checking the header and img_info table */
+} copy_stats;
 
+/* SHA-256 state for the -d store */
 typedef struct {
-	char magic[BOOTLDR_MAGIC_SIZE];
-	unsigned int num_images;
-	unsigned int start_offset;
-	unsigned int bootldr_size;
-} bootldrimgh;
+	unsigned int h[8];
+	unsigned char block[64];
+	unsigned long long length; /* bytes hashed so far */
+	unsigned int used; /* bytes waiting in block */
+} sha256_ctx;
 
+/* partition to pad an image to, from -p or -P */
 typedef struct {
 	char name[64];
-	unsigned int size;
-} img_info;
+	unsigned long long size;
+} ptable_entry;
 
-int main(int argc, char **argv) {
-	FILE *img, *out;
-	void *buf;
-	char *outname;
-	bootldrimgh bimg;
+/* how to unpack, from the cmd args */
+typedef struct {
+	int verbose; /* 1 for -v, -1 to not report images at all */
+	int stream; /* read as stream even if mappable */
+	unsigned int jobs; /* images at the same time within one file */
+	int dirfd; /* where to put the images */
+	int storefd; /* -d store or -1 */
+	ptable_entry *ptable; /* -p/-P partition sizes */
+	unsigned int ptable_count;
+} unpack_opts;
+
+/* shared state of the -j worker pool */
+typedef struct {
+	int fd;
+	const unsigned char *map;
 	img_info *imgs;
-	unsigned int i = 0;
+	off_t *offsets; /* start of every image in the input */
+	int *results; /* EXIT_* per image */
+	copy_stats *stats; /* per image, summed afterwards */
+	char (*digests)[SHA256_HEX_SIZE]; /* per image with -d, else NULL */
+	unpack_opts *opts;
+	unsigned int count;
+	unsigned int next; /* next image to pick up, guarded by lock */
+	pthread_mutex_t lock;
+} unpack_pool;
+
+/* header of a -D patch, followed by count ops, the PATCH_DATA ones by their bytes */
+#define PATCHHDR_FIELDS(U32, BYTES) \
+	BYTES(magic, PATCH_MAGIC_SIZE) \
+	U32(version) \
+	U32(kind) /* PATCH_KIND_* */ \
+	U32(old_size) /* bytes of the old image, the partition holding it may be larger */ \
+	U32(new_size) \
+	U32(count) \
+	BYTES(old_sha256, SHA256_HEX_SIZE - 1) /* lowercase hex, not terminated */ \
+	BYTES(new_sha256, SHA256_HEX_SIZE - 1)
+
+#define PATCHOP_FIELDS(U32, BYTES) \
+	U32(type) /* PATCH_COPY, PATCH_DATA or PATCH_ZERO */ \
+	U32(offset) \
+	U32(len)
+
+typedef struct {
+	LECODEC_STRUCT(PATCHHDR_FIELDS)
+} patchhdr;
+
+typedef struct {
+	LECODEC_STRUCT(PATCHOP_FIELDS)
+} patchop;
+
+LECODEC(patchhdr, PATCHHDR_FIELDS)
+LECODEC(patchop, PATCHOP_FIELDS)
+
+/* ops of a -D patch being made, describing new from its start up to pos */
+typedef struct {
+	patchop *ops;
+	unsigned int count;
+	unsigned int room; /* ops allocated */
+	const unsigned char *new; /* the mapped new image */
+	unsigned long long pos;
+	unsigned long long data; /* bytes of PATCH_DATA */
+} patch_ops;
+
+/* shared state of the -b and -J worker pool */
+typedef struct {
+	char **files;
+	unsigned int count;
+	unsigned int next; /* next file to pick up, guarded by lock */
+	unsigned int failed; /* guarded by lock */
+	int index; /* -J: write a JSON line per file instead of unpacking it */
+	unsigned long long headers; /* header bytes read for -J, guarded by lock */
+	char **dirs; /* output directory per file for -b, NULL where it would be used twice */
+	unpack_opts opts;
+	pthread_mutex_t lock;
+} batch_pool;
+
+/* a -b output directory with the position of its file, to find equal ones by sorting */
+typedef struct {
+	char *name;
+	unsigned int i;
+} batch_name;
+
+static const unsigned int sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(sha256_ctx *ctx) {
+	static const unsigned int init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(ctx->h, init, sizeof(init));
+	ctx->length = 0;
+	ctx->used = 0;
+}
+
+/*
+ * Processes one 64 byte block
+ */
+static void sha256_block(sha256_ctx *ctx, const unsigned char *p) {
+	unsigned int w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		w[i] = (unsigned int) p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+	}
+	for (; i < 64; ++i) {
+		w[i] = w[i - 16] + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			w[i - 7] + (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+	}
+
+	a = ctx->h[0]; b = ctx->h[1]; c = ctx->h[2]; d = ctx->h[3];
+	e = ctx->h[4]; f = ctx->h[5]; g = ctx->h[6]; h = ctx->h[7];
+	for (i = 0; i < 64; ++i) {
+		t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	ctx->h[0] += a; ctx->h[1] += b; ctx->h[2] += c; ctx->h[3] += d;
+	ctx->h[4] += e; ctx->h[5] += f; ctx->h[6] += g; ctx->h[7] += h;
+}
+
+void sha256_update(sha256_ctx *ctx, const unsigned char *data, size_t len) {
+	size_t fill;
+
+	ctx->length += len;
+	if (ctx->used) {
+		fill = 64 - ctx->used < len ? 64 - ctx->used : len;
+		memcpy(ctx->block + ctx->used, data, fill);
+		ctx->used += fill;
+		data += fill;
+		len -= fill;
+		if (ctx->used < 64) {
+			return;
+		}
+		sha256_block(ctx, ctx->block);
+		ctx->used = 0;
+	}
+	for (; len >= 64; data += 64, len -= 64) {
+		sha256_block(ctx, data);
+	}
+	memcpy(ctx->block, data, len);
+	ctx->used = len;
+}
+
+/*
+ * Pads the message and writes the digest as lowercase hex
+ */
+void sha256_final(sha256_ctx *ctx, char hex[SHA256_HEX_SIZE]) {
+	unsigned long long bits = ctx->length * 8;
+	int i;
+
+	ctx->block[ctx->used++] = 0x80;
+	if (ctx->used > 56) {
+		memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+		sha256_block(ctx, ctx->block);
+		ctx->used = 0;
+	}
+	memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+	for (i = 0; i < 8; ++i) {
+		ctx->block[56 + i] = bits >> (56 - 8 * i);
+	}
+	sha256_block(ctx, ctx->block);
+
+	for (i = 0; i < 8; ++i) {
+		sprintf(hex + 8 * i, "%08x", ctx->h[i]);
+	}
+}
+
+/*
+ * Name of the temporary file in the store, unique per thread
+ */
+void store_tmpname(char *name, size_t size) {
+	snprintf(name, size, ".tmp.%d.%lu", (int) getpid(), (unsigned long) pthread_self());
+}
+
+/*
+ * Tells if content with the given digest is already in the store
+ */
+int store_has(int storefd, const char *hex) {
+	char path[SHA256_HEX_SIZE + 1];
+
+	snprintf(path, sizeof(path), "%.2s/%s", hex, hex + 2);
+	return !faccessat(storefd, path, F_OK, 0);
+}
+
+/*
+ * Moves the written tmpname in the store to its content address
+ * A copy that was stored in the meantime is kept and tmpname removed, its size
+ * then counts as deduped instead of written
+ * Returns EXIT_FAILURE if the content could not be put in place
+ */
+int store_commit(int storefd, const char *tmpname, const char *hex, unsigned long long size, copy_stats *stats) {
+	char dir[3], path[SHA256_HEX_SIZE + 1];
 
-	if ((argc != 2 && argc != 3) || (argc == 3 && (argv[1][0] != '-' || argv[1][1] != 'v'))) {
-		printf("Usage: %s [-v] <bootloader.img>\n", argv[0]);
+	if (store_has(storefd, hex)) {
+		unlinkat(storefd, tmpname, 0);
+		stats->written -= size;
+		stats->deduped += size;
+		return EXIT_SUCCESS;
+	}
+
+	snprintf(dir, sizeof(dir), "%.2s", hex);
+	snprintf(path, sizeof(path), "%.2s/%s", hex, hex + 2);
+	if ((mkdirat(storefd, dir, 0777) && errno != EEXIST) || renameat(storefd, tmpname, storefd, path)) {
+		perror("Error storing image");
+		unlinkat(storefd, tmpname, 0);
 		return EXIT_FAILURE;
 	}
 
-	if (argc == 2 && !(img = fopen(argv[1], "r"))) {
-		perror("Error opening file");
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Writes name, size and digest of every image to MANIFEST_NAME in dirfd
+ */
+int write_manifest(int dirfd, img_info *imgs, unsigned int count, char (*digests)[SHA256_HEX_SIZE]) {
+	FILE *out;
+	int fd;
+	unsigned int i;
+
+	if ((fd = openat(dirfd, MANIFEST_NAME, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 || !(out = fdopen(fd, "w"))) {
+		perror("Error opening manifest");
+		if (fd >= 0) close(fd);
 		return EXIT_FAILURE;
 	}
-	if (argc == 3 && !(img = fopen(argv[2], "r"))) {
-		perror("Error opening file");
+	for (i = 0; i < count; ++i) {
+		fprintf(out, "%.*s %u %s\n", (int) sizeof(imgs[i].name), imgs[i].name, imgs[i].size, digests[i]);
+	}
+
+	return fclose(out) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Prints the info from the bootloader.img header
+ */
+void list_header_info(bootldrimgh *bimg) {
+	/* Show complete magic, need to copy so we can terminate */
+	char magicstr[BOOTLDR_MAGIC_SIZE + 1];
+	strncpy(magicstr, bimg->magic, BOOTLDR_MAGIC_SIZE);
+	magicstr[BOOTLDR_MAGIC_SIZE] = '\0';
+
+	printf("magic: %s\n", magicstr);
+	printf("num_images: %d\n", bimg->num_images);
+	printf("start_offset: %d\n", bimg->start_offset);
+	printf("bootldr_size: %d\n", bimg->bootldr_size);
+}
+
+/*
+ * Checks the fixed part of the header: magic, number of images and start of the first one
+ * Returns EXIT_FAILURE if not a valid bootloader.img
+ */
+int check_header(bootldrimgh *bimg) {
+	if (strncmp(bimg->magic, BOOTLDR_MAGIC, BOOTLDR_MAGIC_SIZE)) {
+		fprintf(stderr, "Not a bootloader.img: bad magic\n");
+		return EXIT_FAILURE;
+	}
+	if (bimg->num_images > BOOTLDR_MAX_IMAGES) {
+		fprintf(stderr, "Invalid bootloader.img: %u images\n", bimg->num_images);
+		return EXIT_FAILURE;
+	}
+	/* images can't start inside the table */
+	if (bimg->start_offset < bootldrimgh_size + bimg->num_images * img_info_size) {
+		fprintf(stderr, "Invalid bootloader.img: images start at %u, inside the header\n", bimg->start_offset);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Checks the img_info table against the file it came from, len is 0 when that is unknown (a pipe)
+ * Every image has to lie inside the file and every name has to be usable as a file name
+ * Returns EXIT_FAILURE if not
+ */
+int check_images(bootldrimgh *bimg, img_info *imgs, unsigned long long len) {
+	unsigned long long end = bimg->start_offset;
+	unsigned int i;
+	size_t n;
+
+	for (i = 0; i < bimg->num_images; ++i) {
+		/* names become <name>.img in the output dir */
+		n = strnlen(imgs[i].name, sizeof(imgs[i].name));
+		if (n == 0 || memchr(imgs[i].name, '/', n) != NULL) {
+			fprintf(stderr, "Invalid bootloader.img: image %u has name \"%.*s\"\n", i + 1, (int) n, imgs[i].name);
+			return EXIT_FAILURE;
+		}
+		end += imgs[i].size;
+		if (len > 0 && end > len) {
+			fprintf(stderr, "Invalid bootloader.img: image %.*s ends at %llu, past the end of the file (%llu)\n",
+				(int) n, imgs[i].name, end, len);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Parses the header and img_info table at the start of buf
+ * The table is copied to a newly allocated *imgs
+ * Returns EXIT_FAILURE if not a valid bootloader.img or other problems
+ */
+int parse_header(const unsigned char *buf, size_t len, bootldrimgh *bimg, img_info **imgs) {
+	if (len < bootldrimgh_size) {
+		fprintf(stderr, "Not a bootloader.img: too short\n");
+		return EXIT_FAILURE;
+	}
+	bootldrimgh_decode(bimg, buf);
+	if (check_header(bimg) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	if (bimg->start_offset > len) {
+		fprintf(stderr, "Invalid bootloader.img: images start at %u, past the end of the file\n", bimg->start_offset);
+		return EXIT_FAILURE;
+	}
+
+	*imgs = malloc(bimg->num_images * sizeof(img_info) + 1);
+	if (*imgs == NULL) {
 		return EXIT_FAILURE;
 	}
+	img_info_decode_array(*imgs, buf + bootldrimgh_size, bimg->num_images);
+	if (check_images(bimg, *imgs, len) == EXIT_FAILURE) {
+		free(*imgs);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Reads the header and img_info table from the current position of img
+ * Returns EXIT_FAILURE if not a valid bootloader.img or other problems
+ */
+int read_header(FILE *img, bootldrimgh *bimg, img_info **imgs) {
+	unsigned char hdr[bootldrimgh_size], *table;
 
 	/* Read header without img_info struct */
-	fread(&bimg, sizeof(bootldrimgh), 1, img);
-	/* for printing only */
-	if (argc == 3) {
-		bimg.magic[BOOTLDR_MAGIC_SIZE-1] = 0;
-		printf("magic: %s\n", bimg.magic);
-		printf("num_images: %d\n", bimg.num_images);
-		printf("start_offset: %d\n", bimg.start_offset);
-		printf("bootldr_size: %d\n", bimg.bootldr_size);
+	if (fread(hdr, bootldrimgh_size, 1, img) != 1) {
+		fprintf(stderr, "Not a bootloader.img: too short\n");
+		return EXIT_FAILURE;
+	}
+	bootldrimgh_decode(bimg, hdr);
+	if (check_header(bimg) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
 	}
 
-	/* read img_info headers */
-	imgs = malloc(bimg.num_images * sizeof(img_info));
-	fread(imgs, sizeof(img_info), bimg.num_images, img);
+	/* read img_info headers, the payloads can't be checked against the length of a pipe */
+	*imgs = malloc(bimg->num_images * sizeof(img_info) + 1);
+	table = malloc(bimg->num_images * img_info_size + 1);
+	if (*imgs == NULL || table == NULL) {
+		free(*imgs);
+		free(table);
+		return EXIT_FAILURE;
+	}
+	if (fread(table, img_info_size, bimg->num_images, img) != bimg->num_images) {
+		free(*imgs);
+		free(table);
+		return EXIT_FAILURE;
+	}
+	img_info_decode_array(*imgs, table, bimg->num_images);
+	free(table);
+	if (check_images(bimg, *imgs, 0) == EXIT_FAILURE) {
+		free(*imgs);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
 
-	fseek(img, bimg.start_offset, SEEK_SET);
+/*
+ * Returns the seconds between two timevals
+ */
+double elapsed(struct timeval *start, struct timeval *end) {
+	return (end->tv_sec - start->tv_sec) + (end->tv_usec - start->tv_usec) / 1000000.0;
+}
 
-	for (i = 0; i < bimg.num_images; ++i) {
-		/* Output to name.img, needing 5 more chars of mem */
-		outname = malloc(strlen(imgs[i].name) + 5);
-		sprintf(outname, "%s.img", imgs[i].name);
-		if (!(out = fopen(outname, "w+"))) {
-			perror("Error opening file");
+/*
+ * Reports an image being unpacked
+ */
+void report_output(img_info *info, unsigned int i, int verbose) {
+	if (verbose > 0) {
+		printf("Unpacking image %d = %.*s to %.*s.img (size: %d)\n", i + 1, (int) sizeof(info->name), info->name,
+			(int) sizeof(info->name), info->name, info->size);
+	} else if (verbose == 0) {
+		printf("%.*s\n", (int) sizeof(info->name), info->name);
+	}
+}
+
+/*
+ * Opens <name>.img in dirfd for writing
+ * Returns NULL if the file could not be opened
+ */
+FILE *open_output(int dirfd, img_info *info) {
+	FILE *out;
+	int fd;
+	/* Output to name.img, needing 5 more chars of mem */
+	char outname[sizeof(info->name) + 5];
+
+	/* name is not guaranteed to be terminated */
+	snprintf(outname, sizeof(outname), "%.*s.img", (int) sizeof(info->name), info->name);
+	if ((fd = openat(dirfd, outname, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0 || !(out = fdopen(fd, "w+"))) {
+		perror("Error opening file");
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+
+	return out;
+}
+
+/*
+ * Adds one name:size entry to the partition table
+ * Returns EXIT_FAILURE if entry is not of that form
+ */
+int add_ptable_entry(const char *entry, unpack_opts *opts) {
+	ptable_entry *grown;
+	const char *colon = strchr(entry, ':');
+	char *end;
+	unsigned long long size;
+
+	if (colon == NULL || colon == entry || colon - entry >= sizeof(grown->name)) {
+		return EXIT_FAILURE;
+	}
+	errno = 0;
+	size = strtoull(colon + 1, &end, 0);
+	if (errno || end == colon + 1 || *end != '\0') {
+		return EXIT_FAILURE;
+	}
+
+	grown = realloc(opts->ptable, (opts->ptable_count + 1) * sizeof(ptable_entry));
+	if (grown == NULL) {
+		return EXIT_FAILURE;
+	}
+	opts->ptable = grown;
+	memset(grown[opts->ptable_count].name, 0, sizeof(grown->name));
+	memcpy(grown[opts->ptable_count].name, entry, colon - entry);
+	grown[opts->ptable_count].size = size;
+	++opts->ptable_count;
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Parses a -p list of name:size entries separated by commas or whitespace
+ * Returns EXIT_FAILURE on the first invalid entry
+ */
+int parse_ptable(char *list, unpack_opts *opts) {
+	char *entry;
+
+	for (entry = strtok(list, ", \t\r\n"); entry != NULL; entry = strtok(NULL, ", \t\r\n")) {
+		if (add_ptable_entry(entry, opts) == EXIT_FAILURE) {
+			fprintf(stderr, "Invalid partition %s, expected name:size\n", entry);
 			return EXIT_FAILURE;
 		}
-		if (argc == 3) {
-			printf("Unpacking image %d = %s to %s (size: %d)\n", i + 1, imgs[i].name, outname, imgs[i].size);
-		} else {
-			printf("%s\n", imgs[i].name);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Reads the partition table for -P, every line that is exactly name:size is used
+ * so it can be kept in the bash-style configs as used by dumper.sh and writer.sh
+ */
+int read_ptable(const char *path, unpack_opts *opts) {
+	FILE *fp;
+	char line[256];
+	size_t len;
+
+	if (!(fp = fopen(path, "r"))) {
+		perror("Error opening partition table");
+		return EXIT_FAILURE;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		len = strlen(line);
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+			line[--len] = '\0';
 		}
-		if (outname != NULL) free(outname);
+		/* everything else in there is not for us */
+		add_ptable_entry(line, opts);
+	}
+	fclose(fp);
 
-		/* Read part of file to buffer */
-		buf = malloc(imgs[i].size);
-		fread(buf, imgs[i].size, 1, img);
+	return EXIT_SUCCESS;
+}
 
-		/* Write buffer to file */
-		fwrite(buf, imgs[i].size, 1, out);
+/*
+ * Pads the written image in fd up to its partition size, if it has one
+ * The file is only extended, so the padding is a hole and no zeroes are written
+ */
+int pad_output(int fd, img_info *info, unpack_opts *opts) {
+	unsigned int i;
 
-		fclose(out);
-		if (buf != NULL) free(buf);
+	for (i = 0; i < opts->ptable_count; ++i) {
+		if (strncmp(opts->ptable[i].name, info->name, sizeof(info->name))) {
+			continue;
+		}
+		if (opts->ptable[i].size < info->size) {
+			fprintf(stderr, "Image %.*s is larger than its partition (%llu bytes), not padding\n",
+				(int) sizeof(info->name), info->name, opts->ptable[i].size);
+			return EXIT_SUCCESS;
+		}
+		if (ftruncate(fd, opts->ptable[i].size)) {
+			perror("Error padding file");
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
 	}
 
-	/* Cleaup */
-	if (imgs != NULL) free(imgs);
-	fclose(img);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Writes size bytes at offset of the mapped input to out
+ * Uses copy_file_range so the payload never enters user space, falls back
+ * to writing straight from the mapping if the kernel or filesystem can't
+ * Returns EXIT_FAILURE on short writes or other problems
+ */
+int write_payload_mmap(int infd, const unsigned char *map, off_t offset, size_t size, int outfd, copy_stats *stats) {
+	loff_t inoff = offset;
+	ssize_t done;
+	size_t left = size;
+
+	while (left > 0) {
+		done = copy_file_range(infd, &inoff, outfd, NULL, left, 0);
+		if (done < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+			break;
+		}
+		if (done <= 0) {
+			return EXIT_FAILURE;
+		}
+		left -= done;
+	}
+
+	/* fallback, the mapping is the only copy */
+	while (left > 0) {
+		done = write(outfd, map + (size - left) + offset, left);
+		if (done <= 0) {
+			return EXIT_FAILURE;
+		}
+		stats->copied += done;
+		left -= done;
+	}
 
+	stats->written += size;
 	return EXIT_SUCCESS;
 }
+
+/*
+ * Maps a regular file completely
+ * Returns EXIT_FAILURE if the input is not a (large enough) regular file or can't be mapped
+ */
+int map_input(int fd, unsigned char **map, size_t *len) {
+	struct stat st;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size < bootldrimgh_size) {
+		return EXIT_FAILURE;
+	}
+	*map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (*map == MAP_FAILED) {
+		return EXIT_FAILURE;
+	}
+	*len = st.st_size;
+	madvise(*map, *len, MADV_SEQUENTIAL);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Stores one image of a mapped bootloader.img in the store, unless its digest is already there
+ */
+int store_image(int fd, const unsigned char *map, off_t offset, img_info *info, int storefd, char *digest, copy_stats *stats) {
+	sha256_ctx ctx;
+	char tmpname[64];
+	int out, ret;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, map + offset, info->size);
+	sha256_final(&ctx, digest);
+	if (store_has(storefd, digest)) {
+		stats->deduped += info->size;
+		return EXIT_SUCCESS;
+	}
+
+	store_tmpname(tmpname, sizeof(tmpname));
+	if ((out = openat(storefd, tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		perror("Error opening file");
+		return EXIT_FAILURE;
+	}
+	ret = write_payload_mmap(fd, map, offset, info->size, out, stats);
+	if (close(out) || ret == EXIT_FAILURE) {
+		perror("Error writing file");
+		unlinkat(storefd, tmpname, 0);
+		return EXIT_FAILURE;
+	}
+
+	return store_commit(storefd, tmpname, digest, info->size, stats);
+}
+
+/*
+ * Unpacks one image of a mapped bootloader.img at the given offset to <name>.img
+ * or to the store with -d, filling digest
+ */
+int unpack_image(int fd, const unsigned char *map, off_t offset, img_info *info, unpack_opts *opts, char *digest, copy_stats *stats) {
+	FILE *out;
+	int ret;
+
+	if (opts->storefd >= 0) {
+		return store_image(fd, map, offset, info, opts->storefd, digest, stats);
+	}
+	if (!(out = open_output(opts->dirfd, info))) {
+		return EXIT_FAILURE;
+	}
+	ret = write_payload_mmap(fd, map, offset, info->size, fileno(out), stats);
+	if (ret == EXIT_FAILURE) {
+		perror("Error writing file");
+	} else {
+		ret = pad_output(fileno(out), info, opts);
+	}
+	fclose(out);
+
+	return ret;
+}
+
+/*
+ * Worker of the -j pool, unpacks images until none are left
+ * Only positioned I/O is used, so workers never share a file offset
+ */
+void *unpack_worker(void *data) {
+	unpack_pool *pool = data;
+	unsigned int i;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (i >= pool->count) {
+			break;
+		}
+		pool->results[i] = unpack_image(pool->fd, pool->map, pool->offsets[i], &pool->imgs[i], pool->opts,
+			pool->digests ? pool->digests[i] : NULL, &pool->stats[i]);
+	}
+
+	return NULL;
+}
+
+/*
+ * Unpacks the images of a mapped bootloader.img on a pool of jobs threads
+ * Names are reported in table order once everything is written
+ */
+int unpack_parallel(unpack_pool *pool, unsigned int jobs, int verbose, copy_stats *stats) {
+	pthread_t threads[jobs];
+	unsigned int i, started;
+	int ret = EXIT_SUCCESS;
+
+	pool->next = 0;
+	pool->results = malloc(pool->count * sizeof(int));
+	pool->stats = calloc(pool->count, sizeof(copy_stats));
+	if (pool->results == NULL || pool->stats == NULL) {
+		free(pool->results);
+		free(pool->stats);
+		return EXIT_FAILURE;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+
+	for (started = 0; started < jobs; ++started) {
+		if (pthread_create(&threads[started], NULL, unpack_worker, pool)) {
+			break;
+		}
+	}
+	/* if no thread could be started, do the work ourselves */
+	if (started == 0) {
+		unpack_worker(pool);
+	}
+	for (i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&pool->lock);
+
+	for (i = 0; i < pool->count; ++i) {
+		report_output(&pool->imgs[i], i, verbose);
+		if (pool->results[i] == EXIT_FAILURE) {
+			ret = EXIT_FAILURE;
+		}
+		stats->copied += pool->stats[i].copied;
+		stats->written += pool->stats[i].written;
+		stats->deduped += pool->stats[i].deduped;
+	}
+
+	free(pool->results);
+	free(pool->stats);
+	return ret;
+}
+
+/*
+ * Unpacks a mapped bootloader.img, payloads are written without an intermediate buffer
+ */
+int unpack_mmap(int fd, const unsigned char *map, size_t len, unpack_opts *opts, copy_stats *stats) {
+	bootldrimgh bimg;
+	unpack_pool pool;
+	struct timeval start, end;
+	unsigned int i;
+	int ret = EXIT_SUCCESS;
+
+	gettimeofday(&start, NULL);
+	ret = parse_header(map, len, &bimg, &pool.imgs);
+	gettimeofday(&end, NULL);
+	stats->checked += elapsed(&start, &end);
+	if (ret == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	if (opts->verbose > 0) {
+		list_header_info(&bimg);
+	}
+
+	pool.fd = fd;
+	pool.map = map;
+	pool.count = bimg.num_images;
+	pool.opts = opts;
+	pool.digests = NULL;
+	if (opts->storefd >= 0 && !(pool.digests = calloc(pool.count, SHA256_HEX_SIZE))) {
+		free(pool.imgs);
+		return EXIT_FAILURE;
+	}
+
+	/* images are stored back to back, so every offset is known upfront */
+	pool.offsets = malloc(pool.count * sizeof(off_t));
+	if (pool.offsets == NULL) {
+		free(pool.digests);
+		free(pool.imgs);
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < pool.count; ++i) {
+		pool.offsets[i] = i == 0 ? bimg.start_offset : pool.offsets[i - 1] + pool.imgs[i - 1].size;
+	}
+
+	if (opts->jobs > 1 && pool.count > 1) {
+		ret = unpack_parallel(&pool, opts->jobs < pool.count ? opts->jobs : pool.count, opts->verbose, stats);
+	} else {
+		for (i = 0; i < pool.count; ++i) {
+			report_output(&pool.imgs[i], i, opts->verbose);
+			if (unpack_image(fd, map, pool.offsets[i], &pool.imgs[i], opts,
+				pool.digests ? pool.digests[i] : NULL, stats) == EXIT_FAILURE) {
+				ret = EXIT_FAILURE;
+			}
+		}
+	}
+
+	if (pool.digests != NULL) {
+		if (ret == EXIT_SUCCESS) {
+			ret = write_manifest(opts->dirfd, pool.imgs, pool.count, pool.digests);
+		}
+		free(pool.digests);
+	}
+	free(pool.offsets);
+	free(pool.imgs);
+	return ret;
+}
+
+/*
+ * Copies size bytes from img to out through buf, out can be NULL to skip them
+ * The bytes are hashed as they pass when ctx is not NULL
+ * Returns EXIT_FAILURE on short reads or writes
+ */
+int copy_stream(FILE *img, FILE *out, unsigned long long size, char *buf, sha256_ctx *ctx, copy_stats *stats) {
+	size_t chunk;
+
+	while (size > 0) {
+		chunk = size < STREAM_BUFFER_SIZE ? size : STREAM_BUFFER_SIZE;
+		if (fread(buf, chunk, 1, img) != 1) {
+			return EXIT_FAILURE;
+		}
+		if (ctx != NULL) {
+			sha256_update(ctx, (unsigned char *) buf, chunk);
+		}
+		if (out != NULL) {
+			if (fwrite(buf, chunk, 1, out) != 1) {
+				return EXIT_FAILURE;
+			}
+			/* once into buf, once out of it */
+			stats->copied += 2 * chunk;
+			stats->written += chunk;
+		}
+		size -= chunk;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Unpacks the bootloader.img in one forward pass, so pipes work too
+ * Memory use is bounded by STREAM_BUFFER_SIZE and the img_info table
+ */
+int unpack_stream(FILE *img, unpack_opts *opts, copy_stats *stats) {
+	FILE *out;
+	char buf[STREAM_BUFFER_SIZE], tmpname[64];
+	char (*digests)[SHA256_HEX_SIZE] = NULL;
+	sha256_ctx ctx;
+	bootldrimgh bimg;
+	img_info *imgs;
+	unsigned long long pos;
+	struct timeval start, end;
+	unsigned int i = 0;
+	int ret = EXIT_SUCCESS;
+
+	/* includes reading the table, a pipe can't be checked without */
+	gettimeofday(&start, NULL);
+	ret = read_header(img, &bimg, &imgs);
+	gettimeofday(&end, NULL);
+	stats->checked += elapsed(&start, &end);
+	if (ret == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	/* for printing only */
+	if (opts->verbose > 0) {
+		list_header_info(&bimg);
+	}
+
+	if (opts->storefd >= 0 && !(digests = calloc(bimg.num_images, SHA256_HEX_SIZE))) {
+		free(imgs);
+		return EXIT_FAILURE;
+	}
+
+	/* skip forward to the first image, can't go back */
+	pos = bootldrimgh_size + (unsigned long long) bimg.num_images * img_info_size;
+	if (copy_stream(img, NULL, bimg.start_offset - pos, buf, NULL, stats) == EXIT_FAILURE) {
+		free(digests);
+		free(imgs);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < bimg.num_images && ret == EXIT_SUCCESS; ++i) {
+		report_output(&imgs[i], i, opts->verbose);
+		if (digests != NULL) {
+			/* digest is only known at the end, so write to a temporary file in the store first */
+			store_tmpname(tmpname, sizeof(tmpname));
+			out = fdopen(openat(opts->storefd, tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666), "w");
+			sha256_init(&ctx);
+		} else {
+			out = open_output(opts->dirfd, &imgs[i]);
+		}
+		if (out == NULL) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		ret = copy_stream(img, out, imgs[i].size, buf, digests ? &ctx : NULL, stats);
+		if (ret == EXIT_SUCCESS && digests == NULL) {
+			ret = fflush(out) ? EXIT_FAILURE : pad_output(fileno(out), &imgs[i], opts);
+		}
+		if (fclose(out)) {
+			ret = EXIT_FAILURE;
+		}
+		if (digests != NULL) {
+			sha256_final(&ctx, digests[i]);
+			if (ret == EXIT_SUCCESS) {
+				ret = store_commit(opts->storefd, tmpname, digests[i], imgs[i].size, stats);
+			} else {
+				unlinkat(opts->storefd, tmpname, 0);
+			}
+		}
+	}
+
+	if (digests != NULL) {
+		if (ret == EXIT_SUCCESS) {
+			ret = write_manifest(opts->dirfd, imgs, bimg.num_images, digests);
+		}
+		free(digests);
+	}
+
+	/* Cleaup */
+	if (imgs != NULL) free(imgs);
+
+	return ret;
+}
+
+/*
+ * Unpacks one bootloader.img into opts->dirfd, mapped if possible
+ * Sets *mapped to tell which path was taken
+ */
+int unpack_file(const char *path, unpack_opts *opts, copy_stats *stats, int *mapped) {
+	FILE *img;
+	int fd, ret;
+	unsigned char *map;
+	size_t len;
+
+	if (!strcmp(path, "-")) {
+		fd = STDIN_FILENO;
+	} else if ((fd = open(path, O_RDONLY)) < 0) {
+		perror("Error opening file");
+		return EXIT_FAILURE;
+	}
+
+	*mapped = !opts->stream && map_input(fd, &map, &len) == EXIT_SUCCESS;
+	if (*mapped) {
+		ret = unpack_mmap(fd, map, len, opts, stats);
+		munmap(map, len);
+		close(fd);
+	} else {
+		/* not mappable (or asked not to), read it as a stream */
+		if (!(img = fdopen(fd, "r"))) {
+			perror("Error opening file");
+			close(fd);
+			return EXIT_FAILURE;
+		}
+		ret = unpack_stream(img, opts, stats);
+		fclose(img);
+	}
+
+	if (ret == EXIT_FAILURE) {
+		fprintf(stderr, "Error unpacking %s: not a valid bootloader.img or write error\n", path);
+	}
+	return ret;
+}
+
+/*
+ * Returns the offset of the first nonzero byte in buf, len if all are zero
+ */
+unsigned long long first_nonzero(const unsigned char *buf, unsigned long long len) {
+	static const unsigned char zeroes[VERIFY_BLOCK_SIZE];
+	unsigned long long pos = 0, chunk;
+
+	/* whole blocks against zeroes first, the byte is only looked for in the block holding it */
+	for (; pos < len; pos += chunk) {
+		chunk = len - pos < VERIFY_BLOCK_SIZE ? len - pos : VERIFY_BLOCK_SIZE;
+		if (memcmp(buf + pos, zeroes, chunk)) {
+			break;
+		}
+	}
+	while (pos < len && buf[pos] == 0) {
+		++pos;
+	}
+
+	return pos;
+}
+
+/*
+ * Returns the offset of the first byte differing between a (alen bytes) and b (blen bytes),
+ * with the shorter one taken as padded with zeroes, so zero padding is not a difference
+ * Returns -1 if they are equal
+ */
+long long first_difference(const unsigned char *a, unsigned long long alen, const unsigned char *b, unsigned long long blen) {
+	unsigned long long pos = 0, chunk, common = alen < blen ? alen : blen;
+
+	for (; pos < common; pos += chunk) {
+		chunk = common - pos < VERIFY_BLOCK_SIZE ? common - pos : VERIFY_BLOCK_SIZE;
+		if (memcmp(a + pos, b + pos, chunk)) {
+			break;
+		}
+	}
+	if (pos < common) {
+		while (a[pos] == b[pos]) {
+			++pos;
+		}
+		return pos;
+	}
+
+	/* what is left of the longer one has to be padding */
+	if (alen > blen) {
+		pos = common + first_nonzero(a + common, alen - common);
+		return pos < alen ? (long long) pos : -1;
+	}
+	pos = common + first_nonzero(b + common, blen - common);
+	return pos < blen ? (long long) pos : -1;
+}
+
+/*
+ * Compares one image of a mapped bootloader.img with its dump <name>.img (or <name>) in dumpfd
+ * The dump is mapped as well, nothing is copied or written
+ * Returns EXIT_FAILURE if the dump is missing or differs
+ */
+int verify_image(const unsigned char *map, off_t offset, img_info *info, int dumpfd, int verbose) {
+	char path[sizeof(info->name) + 5];
+	unsigned char *dump = NULL;
+	struct stat st;
+	long long diff;
+	int fd;
+
+	snprintf(path, sizeof(path), "%.*s.img", (int) sizeof(info->name), info->name);
+	if ((fd = openat(dumpfd, path, O_RDONLY)) < 0) {
+		snprintf(path, sizeof(path), "%.*s", (int) sizeof(info->name), info->name);
+		fd = openat(dumpfd, path, O_RDONLY);
+	}
+	if (fd < 0 || fstat(fd, &st)) {
+		printf("%.*s: no dump\n", (int) sizeof(info->name), info->name);
+		if (fd >= 0) close(fd);
+		return EXIT_FAILURE;
+	}
+	/* an empty file can't be mapped, but can still be all padding */
+	if (st.st_size > 0) {
+		dump = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (dump == MAP_FAILED) {
+			perror("Error mapping dump");
+			close(fd);
+			return EXIT_FAILURE;
+		}
+		madvise(dump, st.st_size, MADV_SEQUENTIAL);
+	}
+
+	diff = first_difference(map + offset, info->size, dump, st.st_size);
+	if (diff >= 0) {
+		printf("%.*s: differs from %s at offset %lld\n", (int) sizeof(info->name), info->name, path, diff);
+	} else if (verbose >= 0) {
+		printf("%.*s: matches %s\n", (int) sizeof(info->name), info->name, path);
+	}
+
+	if (dump != NULL) munmap(dump, st.st_size);
+	close(fd);
+	return diff >= 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Compares every image of the bootloader.img at path with its dump in dumpdir (-V)
+ * Returns EXIT_FAILURE if any image is missing or differs
+ */
+int verify_file(const char *path, const char *dumpdir, unpack_opts *opts) {
+	bootldrimgh bimg;
+	img_info *imgs;
+	unsigned char *map;
+	size_t len;
+	off_t offset;
+	unsigned int i, failed = 0;
+	int fd, dumpfd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror("Error opening file");
+		return EXIT_FAILURE;
+	}
+	if (map_input(fd, &map, &len) == EXIT_FAILURE) {
+		fprintf(stderr, "Error verifying %s: not a regular file that can be mapped\n", path);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	if ((dumpfd = open(dumpdir, O_RDONLY | O_DIRECTORY)) < 0) {
+		fprintf(stderr, "Error opening %s: %s\n", dumpdir, strerror(errno));
+		munmap(map, len);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	if (parse_header(map, len, &bimg, &imgs) == EXIT_FAILURE) {
+		close(dumpfd);
+		munmap(map, len);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	if (opts->verbose > 0) {
+		list_header_info(&bimg);
+	}
+
+	/* images are stored back to back */
+	for (i = 0, offset = bimg.start_offset; i < bimg.num_images; offset += imgs[i++].size) {
+		if (verify_image(map, offset, &imgs[i], dumpfd, opts->verbose) == EXIT_FAILURE) {
+			++failed;
+		}
+	}
+	printf("%u images, %u match, %u differ or have no dump\n", bimg.num_images, bimg.num_images - failed, failed);
+
+	free(imgs);
+	close(dumpfd);
+	munmap(map, len);
+	close(fd);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Adds an op describing the next len bytes of new to p, merged with the last op when it continues it
+ * offset is in old for PATCH_COPY, ignored otherwise
+ * Returns EXIT_FAILURE when out of memory
+ */
+int patch_emit(patch_ops *p, unsigned int type, unsigned long long offset, unsigned long long len) {
+	patchop *last = p->count ? &p->ops[p->count - 1] : NULL;
+	patchop *grown;
+
+	if (len == 0) {
+		return EXIT_SUCCESS;
+	}
+	if (type == PATCH_DATA) {
+		p->data += len;
+	}
+	/* data and zeroes always continue, a copy only when the next old bytes are taken */
+	if (last != NULL && last->type == type && (type != PATCH_COPY || last->offset + last->len == offset)) {
+		last->len += len;
+		p->pos += len;
+		return EXIT_SUCCESS;
+	}
+	if (p->count == p->room) {
+		p->room = p->room ? 2 * p->room : 64;
+		if ((grown = realloc(p->ops, p->room * sizeof(patchop))) == NULL) {
+			return EXIT_FAILURE;
+		}
+		p->ops = grown;
+	}
+	p->ops[p->count].type = type;
+	p->ops[p->count].offset = type == PATCH_COPY ? offset : p->pos;
+	p->ops[p->count].len = len;
+	p->count++;
+	p->pos += len;
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Describes the next len bytes of new against the oldlen bytes at oldoff in old, PATCH_BLOCK_SIZE at a time:
+ * a block equal to the one at the same place in old is copied, else it is zeroes or data
+ * Returns EXIT_FAILURE when out of memory
+ */
+int patch_blocks(patch_ops *p, const unsigned char *old, unsigned long long oldoff, unsigned long long oldlen, unsigned long long len) {
+	const unsigned char *new = p->new + p->pos;
+	unsigned long long pos, chunk;
+	int ret = EXIT_SUCCESS;
+
+	for (pos = 0; pos < len && ret == EXIT_SUCCESS; pos += chunk) {
+		chunk = len - pos < PATCH_BLOCK_SIZE ? len - pos : PATCH_BLOCK_SIZE;
+		if (pos + chunk <= oldlen && !memcmp(old + oldoff + pos, new + pos, chunk)) {
+			ret = patch_emit(p, PATCH_COPY, oldoff + pos, chunk);
+		} else if (first_nonzero(new + pos, chunk) == chunk) {
+			ret = patch_emit(p, PATCH_ZERO, 0, chunk);
+		} else {
+			ret = patch_emit(p, PATCH_DATA, 0, chunk);
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Describes the next len bytes of new, the pixelruns of a content, against the oldlen bytes of runs at oldoff in old
+ * The runs the two start and end with are copied, only those in between (where the picture changed) are data
+ * Returns EXIT_FAILURE when out of memory
+ */
+int patch_runs(patch_ops *p, const unsigned char *old, unsigned long long oldoff, unsigned long long oldlen, unsigned long long len) {
+	const unsigned char *a = old + oldoff, *b = p->new + p->pos;
+	unsigned long long common = oldlen < len ? oldlen : len, head = 0, tail = 0;
+
+	/* whole runs only, a run split in two is no run */
+	common -= common % sizeof(pixelrun);
+	while (head < common && !memcmp(a + head, b + head, sizeof(pixelrun))) {
+		head += sizeof(pixelrun);
+	}
+	while (tail < common - head && (oldlen - tail) % sizeof(pixelrun) == 0 && (len - tail) % sizeof(pixelrun) == 0
+			&& !memcmp(a + oldlen - tail - sizeof(pixelrun), b + len - tail - sizeof(pixelrun), sizeof(pixelrun))) {
+		tail += sizeof(pixelrun);
+	}
+
+	if (patch_emit(p, PATCH_COPY, oldoff, head) == EXIT_FAILURE
+			|| patch_emit(p, PATCH_DATA, 0, len - head - tail) == EXIT_FAILURE
+			|| patch_emit(p, PATCH_COPY, oldoff + oldlen - tail, tail) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Decodes the table of the imgdata.img of len bytes at buf to a newly allocated *files
+ * Returns EXIT_FAILURE if it is no valid imgdata.img or a content lies outside of it
+ */
+int imgdata_table(const unsigned char *buf, unsigned long long len, imgdatahdr *hdr, imgdata_file **files) {
+	unsigned int i;
+
+	if (len < imgdatahdr_size) {
+		return EXIT_FAILURE;
+	}
+	imgdatahdr_decode(hdr, buf);
+	if (strncmp(hdr->magic, IMGDATA_MAGIC, IMGDATA_MAGIC_SIZE) || hdr->num_files > IMGDATA_MAX_FILES ||
+			hdr->num_files > (len - imgdatahdr_size) / imgdata_file_size) {
+		return EXIT_FAILURE;
+	}
+	if ((*files = malloc(hdr->num_files * sizeof(imgdata_file) + 1)) == NULL) {
+		return EXIT_FAILURE;
+	}
+	imgdata_file_decode_array(*files, buf + imgdatahdr_size, hdr->num_files);
+	for (i = 0; i < hdr->num_files; ++i) {
+		if ((unsigned long long) (*files)[i].offset + (*files)[i].size > len) {
+			free(*files);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Orders contents by offset for diff_imgdata
+ */
+int compare_offsets(const void *a, const void *b) {
+	const imgdata_file *x = a, *y = b;
+
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/*
+ * Describes the next len bytes of new, an imgdata.img, against the imgdata.img of oldlen bytes at oldoff in old
+ * Every content is diffed by pixelrun against the old content of the same name, or copied from an equal one;
+ * the header, table and padding around them block by block
+ * Returns EXIT_FAILURE, with nothing described, if either is no valid imgdata.img
+ */
+int diff_imgdata(patch_ops *p, const unsigned char *old, unsigned long long oldoff, unsigned long long oldlen, unsigned long long len) {
+	const unsigned char *new = p->new + p->pos;
+	imgdatahdr ohdr, nhdr;
+	imgdata_file *ofiles, *nfiles, *f, *match;
+	unsigned long long done = 0;
+	unsigned int i, j;
+	int ret = EXIT_SUCCESS;
+
+	if (imgdata_table(old + oldoff, oldlen, &ohdr, &ofiles) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	if (imgdata_table(new, len, &nhdr, &nfiles) == EXIT_FAILURE) {
+		free(ofiles);
+		return EXIT_FAILURE;
+	}
+
+	/* shared contents (see iunp -p) come once, in the order they lie in new */
+	qsort(nfiles, nhdr.num_files, sizeof(imgdata_file), compare_offsets);
+	for (i = 0; i < nhdr.num_files && ret == EXIT_SUCCESS; ++i) {
+		f = &nfiles[i];
+		if (f->size == 0 || (unsigned long long) f->offset + f->size <= done) {
+			continue;
+		}
+		if (f->offset < done) {
+			/* overlaps the one before, not made by iunp */
+			ret = patch_blocks(p, old, oldoff + done, done < oldlen ? oldlen - done : 0, f->offset + f->size - done);
+			done = f->offset + f->size;
+			continue;
+		}
+		ret = patch_blocks(p, old, oldoff + done, done < oldlen ? oldlen - done : 0, f->offset - done);
+		match = NULL;
+		for (j = 0; j < ohdr.num_files && match == NULL; ++j) {
+			if (!strncmp(ofiles[j].name, f->name, IMGDATA_FILE_NAME_SIZE)) {
+				match = &ofiles[j];
+			}
+		}
+		for (j = 0; j < ohdr.num_files && match == NULL; ++j) {
+			if (ofiles[j].size == f->size && !memcmp(old + oldoff + ofiles[j].offset, new + f->offset, f->size)) {
+				match = &ofiles[j];
+			}
+		}
+		if (ret == EXIT_FAILURE) {
+			break;
+		} else if (match != NULL) {
+			ret = patch_runs(p, old, oldoff + match->offset, match->size, f->size);
+		} else {
+			ret = patch_blocks(p, old, 0, 0, f->size);
+		}
+		done = f->offset + f->size;
+	}
+	if (ret == EXIT_SUCCESS && done < len) {
+		ret = patch_blocks(p, old, oldoff + done, done < oldlen ? oldlen - done : 0, len - done);
+	}
+
+	free(ofiles);
+	free(nfiles);
+	return ret;
+}
+
+/*
+ * Describes new, a bootloader.img of len bytes, against the bootloader.img old of oldlen bytes
+ * Every image is diffed block by block against the old image of the same name, or copied from an equal one,
+ * its imgdata image content by content (see diff_imgdata)
+ * Returns EXIT_FAILURE, with nothing described, if either is no valid bootloader.img
+ */
+int diff_bootldr(patch_ops *p, const unsigned char *old, unsigned long long oldlen, unsigned long long len) {
+	bootldrimgh obimg, nbimg;
+	img_info *oimgs, *nimgs;
+	unsigned long long *ooffsets, offset, start;
+	unsigned int i, j;
+	int match, ret = EXIT_SUCCESS;
+
+	if (parse_header(old, oldlen, &obimg, &oimgs) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	if (parse_header(p->new, len, &nbimg, &nimgs) == EXIT_FAILURE) {
+		free(oimgs);
+		return EXIT_FAILURE;
+	}
+	if ((ooffsets = malloc(obimg.num_images * sizeof(unsigned long long) + 1)) == NULL) {
+		free(nimgs);
+		free(oimgs);
+		return EXIT_FAILURE;
+	}
+	/* images are stored back to back */
+	for (i = 0, offset = obimg.start_offset; i < obimg.num_images; offset += oimgs[i++].size) {
+		ooffsets[i] = offset;
+	}
+
+	ret = patch_blocks(p, old, 0, oldlen, nbimg.start_offset);
+	for (i = 0; i < nbimg.num_images && ret == EXIT_SUCCESS; ++i) {
+		match = -1;
+		for (j = 0; j < obimg.num_images && match < 0; ++j) {
+			if (!strncmp(oimgs[j].name, nimgs[i].name, sizeof(nimgs[i].name))) {
+				match = j;
+			}
+		}
+		for (j = 0; j < obimg.num_images && match < 0; ++j) {
+			if (oimgs[j].size == nimgs[i].size && !memcmp(old + ooffsets[j], p->new + p->pos, nimgs[i].size)) {
+				match = j;
+			}
+		}
+		start = p->pos;
+		if (match < 0) {
+			ret = patch_blocks(p, old, 0, 0, nimgs[i].size);
+		} else if (!strncmp(nimgs[i].name, BOOTLDR_IMGDATA_NAME, sizeof(nimgs[i].name))
+				&& diff_imgdata(p, old, ooffsets[match], oimgs[match].size, nimgs[i].size) == EXIT_SUCCESS) {
+			continue;
+		} else if (p->pos != start) {
+			/* out of memory halfway through the imgdata image */
+			ret = EXIT_FAILURE;
+		} else {
+			ret = patch_blocks(p, old, ooffsets[match], oimgs[match].size, nimgs[i].size);
+		}
+	}
+	/* anything after the last image */
+	if (ret == EXIT_SUCCESS) {
+		ret = patch_blocks(p, old, p->pos, p->pos < oldlen ? oldlen - p->pos : 0, len - p->pos);
+	}
+
+	free(ooffsets);
+	free(nimgs);
+	free(oimgs);
+	return ret;
+}
+
+/*
+ * Hashes the first len bytes of map as lowercase hex
+ */
+void sha256_buffer(const unsigned char *map, unsigned long long len, char hex[SHA256_HEX_SIZE]) {
+	sha256_ctx ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, map, len);
+	sha256_final(&ctx, hex);
+}
+
+/*
+ * Writes to patchpath what changed from old (oldlen bytes) to new (newlen bytes)
+ * Two bootloader.img or two imgdata.img are compared image by image or content by content,
+ * anything else block by block
+ * Returns EXIT_FAILURE if the patch can't be made or written
+ */
+int write_patch(const char *patchpath, const unsigned char *old, size_t oldlen, const unsigned char *new, size_t newlen, int verbose) {
+	unsigned char hdrbuf[patchhdr_size], opbuf[patchop_size];
+	char hex[SHA256_HEX_SIZE];
+	patch_ops p = {NULL, 0, 0, new, 0, 0};
+	patchhdr hdr;
+	unsigned int i;
+	int ret;
+	FILE *out;
+
+	if (oldlen > PATCH_MAX_SIZE || newlen > PATCH_MAX_SIZE) {
+		fprintf(stderr, "Error diffing: files have to be smaller than 4GiB\n");
+		return EXIT_FAILURE;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PATCH_MAGIC, PATCH_MAGIC_SIZE);
+	hdr.version = PATCH_VERSION;
+	hdr.old_size = oldlen;
+	hdr.new_size = newlen;
+
+	/* a header that turns out invalid describes nothing, the next way is tried */
+	if (!memcmp(old, BOOTLDR_MAGIC, BOOTLDR_MAGIC_SIZE) && !memcmp(new, BOOTLDR_MAGIC, BOOTLDR_MAGIC_SIZE)
+			&& diff_bootldr(&p, old, oldlen, newlen) == EXIT_SUCCESS) {
+		hdr.kind = PATCH_KIND_BOOTLDR;
+	} else if (p.pos == 0 && !memcmp(old, IMGDATA_MAGIC, IMGDATA_MAGIC_SIZE) && !memcmp(new, IMGDATA_MAGIC, IMGDATA_MAGIC_SIZE)
+			&& diff_imgdata(&p, old, 0, oldlen, newlen) == EXIT_SUCCESS) {
+		hdr.kind = PATCH_KIND_IMGDATA;
+	} else if (p.pos != 0 || patch_blocks(&p, old, 0, oldlen, newlen) == EXIT_FAILURE) {
+		fprintf(stderr, "Error diffing: out of memory\n");
+		free(p.ops);
+		return EXIT_FAILURE;
+	} else {
+		hdr.kind = PATCH_KIND_BLOCKS;
+	}
+	hdr.count = p.count;
+	sha256_buffer(old, oldlen, hex);
+	memcpy(hdr.old_sha256, hex, sizeof(hdr.old_sha256));
+	sha256_buffer(new, newlen, hex);
+	memcpy(hdr.new_sha256, hex, sizeof(hdr.new_sha256));
+
+	if (!(out = fopen(patchpath, "wb"))) {
+		perror("Error opening patch");
+		free(p.ops);
+		return EXIT_FAILURE;
+	}
+	patchhdr_encode(hdrbuf, &hdr);
+	ret = fwrite(hdrbuf, patchhdr_size, 1, out) == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+	for (i = 0; i < p.count && ret == EXIT_SUCCESS; ++i) {
+		if (verbose > 0) {
+			printf("%s %u bytes at %u\n", p.ops[i].type == PATCH_COPY ? "copy" : p.ops[i].type == PATCH_ZERO ? "zero" : "data",
+				p.ops[i].len, p.ops[i].offset);
+		}
+		patchop_encode(opbuf, &p.ops[i]);
+		if (fwrite(opbuf, patchop_size, 1, out) != 1
+				|| (p.ops[i].type == PATCH_DATA && fwrite(new + p.ops[i].offset, p.ops[i].len, 1, out) != 1)) {
+			ret = EXIT_FAILURE;
+		}
+	}
+	if (fclose(out) || ret == EXIT_FAILURE) {
+		fprintf(stderr, "Error writing patch %s\n", patchpath);
+		unlink(patchpath);
+		ret = EXIT_FAILURE;
+	} else {
+		printf("%s: %s, %u ops, %llu of %zu bytes as data, %llu bytes\n", patchpath,
+			hdr.kind == PATCH_KIND_BOOTLDR ? "bootloader.img" : hdr.kind == PATCH_KIND_IMGDATA ? "imgdata.img" : "blocks",
+			p.count, p.data, newlen, (unsigned long long) patchhdr_size + p.count * patchop_size + p.data);
+	}
+
+	free(p.ops);
+	return ret;
+}
+
+/*
+ * Maps the files at oldpath and newpath and writes what changed between them to patchpath (-D)
+ * Returns EXIT_FAILURE if an input can't be mapped or the patch can't be written
+ */
+int diff_files(const char *patchpath, const char *oldpath, const char *newpath, int verbose) {
+	unsigned char *old, *new;
+	size_t oldlen, newlen;
+	int oldfd, newfd, ret;
+
+	if ((oldfd = open(oldpath, O_RDONLY)) < 0 || map_input(oldfd, &old, &oldlen) == EXIT_FAILURE) {
+		fprintf(stderr, "Error diffing %s: not a regular file that can be mapped\n", oldpath);
+		if (oldfd >= 0) close(oldfd);
+		return EXIT_FAILURE;
+	}
+	if ((newfd = open(newpath, O_RDONLY)) < 0 || map_input(newfd, &new, &newlen) == EXIT_FAILURE) {
+		fprintf(stderr, "Error diffing %s: not a regular file that can be mapped\n", newpath);
+		if (newfd >= 0) close(newfd);
+		munmap(old, oldlen);
+		close(oldfd);
+		return EXIT_FAILURE;
+	}
+	/* old is looked at where images and contents used to be */
+	madvise(old, oldlen, MADV_RANDOM);
+
+	ret = write_patch(patchpath, old, oldlen, new, newlen, verbose);
+
+	munmap(new, newlen);
+	close(newfd);
+	munmap(old, oldlen);
+	close(oldfd);
+	return ret;
+}
+
+/*
+ * Rebuilds newpath from the file (or partition) at oldpath and the patch at patchpath (-A)
+ * old has to start with the bytes the patch was made from, newpath is only kept when its SHA-256 matches
+ * Returns EXIT_FAILURE if the patch doesn't apply or newpath isn't exactly what it was made from
+ */
+int apply_patch(const char *patchpath, const char *oldpath, const char *newpath) {
+	FILE *patch, *old, *out;
+	unsigned char hdrbuf[patchhdr_size], opbuf[patchop_size];
+	char buf[STREAM_BUFFER_SIZE], hex[SHA256_HEX_SIZE];
+	struct stat ost, nst;
+	copy_stats stats = {0, 0, 0, 0};
+	unsigned long long pos = 0, data = 0, chunk, left;
+	sha256_ctx ctx;
+	patchhdr hdr;
+	patchop op;
+	unsigned int i;
+	int regular, ret = EXIT_SUCCESS;
+
+	if (!(patch = fopen(patchpath, "rb"))) {
+		perror("Error opening patch");
+		return EXIT_FAILURE;
+	}
+	if (fread(hdrbuf, patchhdr_size, 1, patch) != 1) {
+		fprintf(stderr, "Not a patch: too short\n");
+		fclose(patch);
+		return EXIT_FAILURE;
+	}
+	patchhdr_decode(&hdr, hdrbuf);
+	if (memcmp(hdr.magic, PATCH_MAGIC, PATCH_MAGIC_SIZE) || hdr.version != PATCH_VERSION) {
+		fprintf(stderr, "Not a patch: bad magic or version\n");
+		fclose(patch);
+		return EXIT_FAILURE;
+	}
+	if (!(old = fopen(oldpath, "rb"))) {
+		perror("Error opening old image");
+		fclose(patch);
+		return EXIT_FAILURE;
+	}
+	/* rebuilding in place would overwrite what is still to be copied */
+	if (!stat(newpath, &nst) && !fstat(fileno(old), &ost) && nst.st_dev == ost.st_dev && nst.st_ino == ost.st_ino) {
+		fprintf(stderr, "Error applying patch: %s is %s, write the new image elsewhere first\n", newpath, oldpath);
+		fclose(old);
+		fclose(patch);
+		return EXIT_FAILURE;
+	}
+
+	/* a partition holds more than the image, only the first old_size bytes count */
+	sha256_init(&ctx);
+	if (copy_stream(old, NULL, hdr.old_size, buf, &ctx, &stats) == EXIT_FAILURE) {
+		fprintf(stderr, "Error applying patch: %s is shorter than the %u bytes it was made from\n", oldpath, hdr.old_size);
+		fclose(old);
+		fclose(patch);
+		return EXIT_FAILURE;
+	}
+	sha256_final(&ctx, hex);
+	if (memcmp(hex, hdr.old_sha256, sizeof(hdr.old_sha256))) {
+		fprintf(stderr, "Error applying patch: %s is not the image it was made from\n", oldpath);
+		fclose(old);
+		fclose(patch);
+		return EXIT_FAILURE;
+	}
+	if (!(out = fopen(newpath, "wb"))) {
+		perror("Error opening new image");
+		fclose(old);
+		fclose(patch);
+		return EXIT_FAILURE;
+	}
+	/* a partition written to directly is never removed */
+	regular = !fstat(fileno(out), &nst) && S_ISREG(nst.st_mode);
+
+	sha256_init(&ctx);
+	for (i = 0; i < hdr.count && ret == EXIT_SUCCESS; ++i) {
+		if (fread(opbuf, patchop_size, 1, patch) != 1) {
+			fprintf(stderr, "Error applying patch: truncated after %u of %u ops\n", i, hdr.count);
+			ret = EXIT_FAILURE;
+			break;
+		}
+		patchop_decode(&op, opbuf);
+		if (op.len > hdr.new_size - pos) {
+			fprintf(stderr, "Error applying patch: op %u ends past the new image\n", i);
+			ret = EXIT_FAILURE;
+		} else if (op.type == PATCH_COPY) {
+			if ((unsigned long long) op.offset + op.len > hdr.old_size || fseeko(old, op.offset, SEEK_SET)
+					|| copy_stream(old, out, op.len, buf, &ctx, &stats) == EXIT_FAILURE) {
+				fprintf(stderr, "Error applying patch: op %u can't copy %u bytes at %u\n", i, op.len, op.offset);
+				ret = EXIT_FAILURE;
+			}
+		} else if (op.type == PATCH_DATA) {
+			if (op.offset != pos || copy_stream(patch, out, op.len, buf, &ctx, &stats) == EXIT_FAILURE) {
+				fprintf(stderr, "Error applying patch: op %u has no %u bytes of data for %llu\n", i, op.len, pos);
+				ret = EXIT_FAILURE;
+			}
+			data += op.len;
+		} else if (op.type == PATCH_ZERO) {
+			memset(buf, 0, sizeof(buf));
+			for (left = op.len; left > 0 && ret == EXIT_SUCCESS; left -= chunk) {
+				chunk = left < sizeof(buf) ? left : sizeof(buf);
+				sha256_update(&ctx, (unsigned char *) buf, chunk);
+				if (fwrite(buf, chunk, 1, out) != 1) {
+					ret = EXIT_FAILURE;
+				}
+			}
+		} else {
+			fprintf(stderr, "Error applying patch: op %u of unknown type %u\n", i, op.type);
+			ret = EXIT_FAILURE;
+		}
+		pos += op.len;
+	}
+	if (ret == EXIT_SUCCESS && (pos != hdr.new_size || fgetc(patch) != EOF)) {
+		fprintf(stderr, "Error applying patch: ops make %llu of %u bytes or data is left\n", pos, hdr.new_size);
+		ret = EXIT_FAILURE;
+	}
+	sha256_final(&ctx, hex);
+	if (ret == EXIT_SUCCESS && memcmp(hex, hdr.new_sha256, sizeof(hdr.new_sha256))) {
+		fprintf(stderr, "Error applying patch: SHA-256 of %s is %s, not %.64s\n", newpath, hex, hdr.new_sha256);
+		ret = EXIT_FAILURE;
+	}
+	if (fclose(out) && ret == EXIT_SUCCESS) {
+		perror("Error writing new image");
+		ret = EXIT_FAILURE;
+	}
+	if (ret == EXIT_FAILURE && regular) {
+		unlink(newpath);
+	} else if (ret == EXIT_SUCCESS) {
+		printf("%s: %u bytes, %llu from the patch, SHA-256 %s matches\n", newpath, hdr.new_size, data, hex);
+	}
+
+	fclose(old);
+	fclose(patch);
+	return ret;
+}
+
+/*
+ * Returns the length of the UTF-8 sequence at c, which has at most max bytes, 0 if it isn't a valid one
+ * Overlong forms, surrogates and code points past U+10FFFF are not valid
+ */
+size_t utf8_length(const unsigned char *c, size_t max) {
+	unsigned char lo = 0x80, hi = 0xbf;
+	size_t len, i;
+
+	if (c[0] < 0x80) {
+		return 1;
+	} else if (c[0] >= 0xc2 && c[0] <= 0xdf) {
+		len = 2;
+	} else if (c[0] >= 0xe0 && c[0] <= 0xef) {
+		len = 3;
+		lo = c[0] == 0xe0 ? 0xa0 : 0x80;
+		hi = c[0] == 0xed ? 0x9f : 0xbf;
+	} else if (c[0] >= 0xf0 && c[0] <= 0xf4) {
+		len = 4;
+		lo = c[0] == 0xf0 ? 0x90 : 0x80;
+		hi = c[0] == 0xf4 ? 0x8f : 0xbf;
+	} else {
+		return 0;
+	}
+	if (len > max || c[1] < lo || c[1] > hi) {
+		return 0;
+	}
+	for (i = 2; i < len; ++i) {
+		if (c[i] < 0x80 || c[i] > 0xbf) {
+			return 0;
+		}
+	}
+
+	return len;
+}
+
+/*
+ * Writes at most max chars of str as a JSON string, ending at the first \0
+ * UTF-8 passes as is, only control chars, " and \ are escaped. Bytes that aren't
+ * UTF-8 can't be put in a JSON string, they become U+FFFD
+ * Returns 1 if any byte was replaced like that, 0 if not
+ */
+int json_string(FILE *out, const char *str, size_t max) {
+	const unsigned char *c = (const unsigned char *) str;
+	size_t len;
+	int replaced = 0;
+
+	max = strnlen(str, max);
+	fputc('"', out);
+	while (max > 0) {
+		if (*c == '"' || *c == '\\') {
+			fputc('\\', out);
+			fputc(*c, out);
+			len = 1;
+		} else if (*c < 0x20) {
+			fprintf(out, "\\u%04x", *c);
+			len = 1;
+		} else if ((len = utf8_length(c, max)) > 0) {
+			fwrite(c, 1, len, out);
+		} else {
+			fputs("\\ufffd", out);
+			replaced = 1;
+			len = 1;
+		}
+		c += len;
+		max -= len;
+	}
+	fputc('"', out);
+
+	return replaced;
+}
+
+/*
+ * Writes the member "key":str of at most max chars (see json_string), preceded by sep
+ * A str that isn't all UTF-8 also gets "key_hex" with its bytes, so nothing is lost
+ */
+void json_member(FILE *out, const char *sep, const char *key, const char *str, size_t max) {
+	size_t i;
+
+	fprintf(out, "%s\"%s\":", sep, key);
+	if (json_string(out, str, max)) {
+		fprintf(out, ",\"%s_hex\":\"", key);
+		for (i = 0; i < max && str[i] != '\0'; ++i) {
+			fprintf(out, "%02x", (unsigned char) str[i]);
+		}
+		fputc('"', out);
+	}
+}
+
+/*
+ * Writes the table of the imgdata.img of size bytes at offset base in fd as JSON members
+ * Only its header (up to IMGDATA_FILE_OFFSET_START bytes) is read, none of the contents
+ * Returns EXIT_FAILURE if the header isn't valid, with an error member written
+ */
+int index_imgdata(int fd, off_t base, unsigned long long size, FILE *out, unsigned long long *headers) {
+	unsigned char raw[IMGDATA_FILE_OFFSET_START];
+	imgdatahdr hdr;
+	imgdata_file file;
+	ssize_t n;
+	unsigned int i;
+
+	n = pread(fd, raw, size < sizeof(raw) ? size : sizeof(raw), base);
+	if (n < (ssize_t) imgdatahdr_size) {
+		fprintf(out, ",\"error\":\"imgdata header unreadable\"");
+		return EXIT_FAILURE;
+	}
+	*headers += n;
+	imgdatahdr_decode(&hdr, raw);
+	if (strncmp(hdr.magic, IMGDATA_MAGIC, IMGDATA_MAGIC_SIZE) || hdr.num_files > IMGDATA_MAX_FILES ||
+			hdr.num_files > (n - imgdatahdr_size) / imgdata_file_size) {
+		fprintf(out, ",\"error\":\"invalid imgdata header\"");
+		return EXIT_FAILURE;
+	}
+
+	fprintf(out, ",\"num_files\":%u,\"contents\":[", hdr.num_files);
+	for (i = 0; i < hdr.num_files; ++i) {
+		imgdata_file_decode(&file, raw + imgdatahdr_size + i * imgdata_file_size);
+		json_member(out, i ? ",{" : "{", "name", file.name, sizeof(file.name));
+		fprintf(out, ",\"width\":%u,\"height\":%u,\"x\":%u,\"y\":%u,\"offset\":%u,\"size\":%u}", file.imgwidth,
+			file.imgheight, file.scrxpos, file.scrypos, file.offset, file.size);
+	}
+	fputc(']', out);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Writes the tables of the bootloader.img in fd of len bytes as JSON members, hdr holding its first bytes
+ * The contents of its imgdata image are listed as well, again only reading its header
+ * Returns EXIT_FAILURE if a header isn't valid, with an error member written
+ */
+int index_bootldr(int fd, const unsigned char *hdr, unsigned long long len, FILE *out, unsigned long long *headers) {
+	bootldrimgh bimg;
+	img_info *imgs;
+	unsigned char *raw;
+	unsigned long long offset;
+	unsigned int i;
+	int ret = EXIT_SUCCESS;
+
+	bootldrimgh_decode(&bimg, hdr);
+	if (check_header(&bimg) == EXIT_FAILURE) {
+		fprintf(out, ",\"error\":\"invalid bootloader header\"");
+		return EXIT_FAILURE;
+	}
+
+	raw = malloc(bimg.num_images * img_info_size + 1);
+	imgs = malloc(bimg.num_images * sizeof(img_info) + 1);
+	if (raw == NULL || imgs == NULL ||
+			pread(fd, raw, bimg.num_images * img_info_size, bootldrimgh_size) != (ssize_t) (bimg.num_images * img_info_size)) {
+		fprintf(out, ",\"error\":\"bootloader table unreadable\"");
+		free(raw);
+		free(imgs);
+		return EXIT_FAILURE;
+	}
+	*headers += bootldrimgh_size + bimg.num_images * img_info_size;
+	img_info_decode_array(imgs, raw, bimg.num_images);
+	free(raw);
+	if (check_images(&bimg, imgs, len) == EXIT_FAILURE) {
+		fprintf(out, ",\"error\":\"invalid bootloader table\"");
+		free(imgs);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(out, ",\"num_images\":%u,\"start_offset\":%u,\"bootldr_size\":%u,\"images\":[", bimg.num_images,
+		bimg.start_offset, bimg.bootldr_size);
+	/* images are stored back to back */
+	for (i = 0, offset = bimg.start_offset; i < bimg.num_images; offset += imgs[i++].size) {
+		json_member(out, i ? ",{" : "{", "name", imgs[i].name, sizeof(imgs[i].name));
+		fprintf(out, ",\"offset\":%llu,\"size\":%u", offset, imgs[i].size);
+		if (!strncmp(imgs[i].name, BOOTLDR_IMGDATA_NAME, sizeof(imgs[i].name)) &&
+				index_imgdata(fd, offset, imgs[i].size, out, headers) == EXIT_FAILURE) {
+			ret = EXIT_FAILURE;
+		}
+		fputc('}', out);
+	}
+	fputc(']', out);
+
+	free(imgs);
+	return ret;
+}
+
+/*
+ * Writes one JSON line describing the bootloader.img or imgdata.img at path to out (-J)
+ * Only headers and tables are read, never the images or contents
+ * Returns EXIT_FAILURE if it isn't either or its headers aren't valid, with an error member written
+ */
+int index_file(const char *path, FILE *out, unsigned long long *headers) {
+	unsigned char hdr[bootldrimgh_size > IMGDATA_MAGIC_SIZE ? bootldrimgh_size : IMGDATA_MAGIC_SIZE];
+	struct stat st;
+	int fd, ret = EXIT_FAILURE;
+
+	json_member(out, "{", "file", path, strlen(path));
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st)) {
+		const char *err = strerror(errno);
+
+		json_member(out, ",", "error", err, strlen(err));
+		fputs("}\n", out);
+		if (fd >= 0) close(fd);
+		return EXIT_FAILURE;
+	}
+	fprintf(out, ",\"size\":%llu", (unsigned long long) st.st_size);
+
+	if (pread(fd, hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr)) {
+		fprintf(out, ",\"error\":\"too short\"");
+	} else if (!memcmp(hdr, BOOTLDR_MAGIC, BOOTLDR_MAGIC_SIZE)) {
+		fprintf(out, ",\"format\":\"bootloader\"");
+		ret = index_bootldr(fd, hdr, st.st_size, out, headers);
+	} else if (!memcmp(hdr, IMGDATA_MAGIC, IMGDATA_MAGIC_SIZE)) {
+		fprintf(out, ",\"format\":\"imgdata\"");
+		ret = index_imgdata(fd, 0, st.st_size, out, headers);
+	} else {
+		fprintf(out, ",\"error\":\"unknown format\"");
+	}
+	fputs("}\n", out);
+
+	close(fd);
+	return ret;
+}
+
+/*
+ * Orders batch names by name, equal names by position
+ */
+int compare_names(const void *a, const void *b) {
+	const batch_name *x = a, *y = b;
+	int diff = strcmp(x->name, y->name);
+
+	return diff ? diff : (x->i > y->i) - (x->i < y->i);
+}
+
+/*
+ * Names the output directory of every file of a batch <outdir>/<basename without .img>
+ * A basename more files have gets the position of the file appended, as in bootloader.2,
+ * so they are not written over each other. A directory still named twice after that
+ * (a file could be called bootloader.2.img) stays NULL for all but the first file
+ * Returns EXIT_FAILURE if out of memory, dirs then holds what was allocated so far
+ */
+int batch_dirnames(char **files, unsigned int count, const char *outdir, char **dirs) {
+	batch_name *names;
+	unsigned char *dup;
+	unsigned int i, k, first;
+	char *base, *dot, *copy;
+	size_t size;
+
+	names = malloc((count > 0 ? count : 1) * sizeof(batch_name));
+	dup = calloc(count > 0 ? count : 1, 1);
+	if (names == NULL || dup == NULL) {
+		free(names);
+		free(dup);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < count; ++i) {
+		/* basename may modify its argument */
+		if (!(copy = strdup(files[i]))) {
+			free(names);
+			free(dup);
+			return EXIT_FAILURE;
+		}
+		base = basename(copy);
+		dot = strrchr(base, '.');
+		if (dot != NULL && !strcmp(dot, ".img")) {
+			*dot = '\0';
+		}
+		/* room for the position */
+		size = strlen(outdir) + strlen(base) + 2 + 12;
+		if ((dirs[i] = malloc(size)) != NULL) {
+			snprintf(dirs[i], size, "%s/%s", outdir, base);
+		}
+		free(copy);
+		if (dirs[i] == NULL) {
+			free(names);
+			free(dup);
+			return EXIT_FAILURE;
+		}
+		names[i].name = dirs[i];
+		names[i].i = i;
+	}
+
+	/* the same basename more than once gets positions */
+	qsort(names, count, sizeof(batch_name), compare_names);
+	for (k = 1; k < count; ++k) {
+		if (!strcmp(names[k - 1].name, names[k].name)) {
+			dup[names[k - 1].i] = dup[names[k].i] = 1;
+		}
+	}
+	for (i = 0; i < count; ++i) {
+		if (dup[i]) {
+			snprintf(dirs[i] + strlen(dirs[i]), 13, ".%u", i + 1);
+		}
+		names[i].name = dirs[i];
+		names[i].i = i;
+	}
+
+	/* a name that is still taken goes to the first file only */
+	qsort(names, count, sizeof(batch_name), compare_names);
+	for (k = 1, first = 0; k < count; ++k) {
+		if (!strcmp(names[first].name, names[k].name)) {
+			free(dirs[names[k].i]);
+			dirs[names[k].i] = NULL;
+		} else {
+			first = k;
+		}
+	}
+
+	free(names);
+	free(dup);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Frees the output directories of batch_dirnames, dirs may be NULL
+ */
+void free_dirs(char **dirs, unsigned int count) {
+	unsigned int i;
+
+	if (dirs != NULL) {
+		for (i = 0; i < count; ++i) {
+			free(dirs[i]);
+		}
+	}
+	free(dirs);
+}
+
+/*
+ * Unpacks one file of a batch into dirname (see batch_dirnames) and reports its throughput
+ */
+int unpack_batch_file(const char *path, const char *dirname, unpack_opts *opts) {
+	copy_stats stats = {0, 0, 0, 0};
+	struct timeval start, end;
+	unpack_opts fopts = *opts;
+	int mapped, ret;
+	double secs;
+
+	if (access(path, R_OK)) {
+		fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (dirname == NULL) {
+		fprintf(stderr, "Error unpacking %s: its output directory is already used by another file\n", path);
+		return EXIT_FAILURE;
+	}
+
+	if (mkdir(dirname, 0777) && errno != EEXIST) {
+		fprintf(stderr, "Error creating %s: %s\n", dirname, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if ((fopts.dirfd = open(dirname, O_RDONLY | O_DIRECTORY)) < 0) {
+		fprintf(stderr, "Error opening %s: %s\n", dirname, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	gettimeofday(&start, NULL);
+	ret = unpack_file(path, &fopts, &stats, &mapped);
+	gettimeofday(&end, NULL);
+	close(fopts.dirfd);
+
+	secs = elapsed(&start, &end);
+	printf("%s: %s, %llu bytes in %.6f s (%.1f MiB/s, header checks %.6f s) to %s\n", path, ret == EXIT_SUCCESS ? "ok" : "failed",
+		stats.written + stats.deduped, secs, secs > 0 ? (stats.written + stats.deduped) / secs / (1024 * 1024) : 0.0,
+		stats.checked, dirname);
+
+	return ret;
+}
+
+/*
+ * Indexes one file for the -J pool
+ * The line is built in memory first, so lines of workers don't interleave on stdout
+ */
+void index_batch_file(batch_pool *pool, const char *path) {
+	unsigned long long headers = 0;
+	char *line = NULL;
+	size_t size = 0;
+	FILE *out;
+	int ret;
+
+	if ((out = open_memstream(&line, &size)) == NULL) {
+		ret = EXIT_FAILURE;
+	} else {
+		ret = index_file(path, out, &headers);
+		fclose(out);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (line != NULL) {
+		fwrite(line, 1, size, stdout);
+	}
+	pool->headers += headers;
+	if (ret == EXIT_FAILURE) {
+		++pool->failed;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	free(line);
+}
+
+/*
+ * Worker of the -b and -J pool, unpacks or indexes files until none are left
+ */
+void *batch_worker(void *data) {
+	batch_pool *pool = data;
+	unsigned int i;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (i >= pool->count) {
+			break;
+		}
+		if (pool->index) {
+			index_batch_file(pool, pool->files[i]);
+		} else if (unpack_batch_file(pool->files[i], pool->dirs[i], &pool->opts) == EXIT_FAILURE) {
+			pthread_mutex_lock(&pool->lock);
+			++pool->failed;
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Appends the lines of list (- for stdin) to *files
+ * Returns EXIT_FAILURE if the list can't be read
+ */
+int read_file_list(const char *list, char ***files, unsigned int *count) {
+	FILE *fp;
+	char *line = NULL, **grown;
+	size_t cap = 0;
+	ssize_t read;
+
+	if (!strcmp(list, "-")) {
+		fp = stdin;
+	} else if (!(fp = fopen(list, "r"))) {
+		perror("Error opening file list");
+		return EXIT_FAILURE;
+	}
+
+	while ((read = getline(&line, &cap, fp)) > 0) {
+		while (read > 0 && (line[read - 1] == '\n' || line[read - 1] == '\r')) {
+			line[--read] = '\0';
+		}
+		if (read == 0) {
+			continue;
+		}
+		grown = realloc(*files, (*count + 1) * sizeof(char *));
+		if (grown == NULL || !(grown[*count] = strdup(line))) {
+			free(line);
+			return EXIT_FAILURE;
+		}
+		*files = grown;
+		++(*count);
+	}
+
+	free(line);
+	if (fp != stdin) fclose(fp);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Unpacks all given files, jobs files at the same time
+ * Every file itself is unpacked serially, the pool is spread over files
+ */
+int unpack_batch(char **files, unsigned int count, const char *outdir, unsigned int jobs, unpack_opts *opts, int index) {
+	batch_pool pool;
+	pthread_t *threads;
+	unsigned int i, started;
+	struct timeval start, end;
+	unsigned long long total = 0;
+	double secs;
+
+	pool.files = files;
+	pool.count = count;
+	pool.next = 0;
+	pool.failed = 0;
+	pool.index = index;
+	pool.headers = 0;
+	pool.dirs = NULL;
+	pool.opts = *opts;
+	pool.opts.jobs = 1;
+	pool.opts.verbose = -1;
+	if (!index && ((pool.dirs = calloc(count > 0 ? count : 1, sizeof(char *))) == NULL ||
+		batch_dirnames(files, count, outdir, pool.dirs) == EXIT_FAILURE)) {
+		fprintf(stderr, "Failed to allocate memory for the output directories\n");
+		free_dirs(pool.dirs, count);
+		return EXIT_FAILURE;
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+
+	/* no more threads than files, without any do the work ourselves */
+	if (jobs > count) {
+		jobs = count;
+	}
+	threads = malloc((jobs > 1 ? jobs : 1) * sizeof(pthread_t));
+
+	gettimeofday(&start, NULL);
+	for (started = 0; threads != NULL && started < jobs; ++started) {
+		if (pthread_create(&threads[started], NULL, batch_worker, &pool)) {
+			break;
+		}
+	}
+	if (started == 0) {
+		batch_worker(&pool);
+	}
+	for (i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	gettimeofday(&end, NULL);
+	pthread_mutex_destroy(&pool.lock);
+	free(threads);
+
+	secs = elapsed(&start, &end);
+	/* stdout holds the index, which only cost reading the headers */
+	if (index) {
+		fprintf(stderr, "%u files, %u failed, %llu header bytes read in %.6f s (%.1f files/s)\n", count, pool.failed,
+			pool.headers, secs, secs > 0 ? count / secs : 0.0);
+		return pool.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	for (i = 0; i < count; ++i) {
+		struct stat st;
+		if (!stat(files[i], &st)) {
+			total += st.st_size;
+		}
+	}
+	printf("%u files, %u failed, %llu input bytes in %.6f s (%.1f files/s, %.1f MiB/s)\n", count, pool.failed,
+		total, secs, secs > 0 ? count / secs : 0.0, secs > 0 ? total / secs / (1024 * 1024) : 0.0);
+
+	free_dirs(pool.dirs, count);
+	return pool.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void print_usage(char *prog) {
+	printf("Usage: %s [-v] [-s] [-t] [-j N] [-d <store>] [-p <ptable>] [-P <file>] <bootloader.img|->\n", prog);
+	printf("       %s -b [-s] [-j N] [-d <store>] [-p <ptable>] [-P <file>] [-o <dir>] [-f <list>] [<bootloader.img> ...]\n", prog);
+	printf("       %s -V <dumpdir> [-v] <bootloader.img>\n", prog);
+	printf("       %s -J [-j N] [-f <list>] [<bootloader.img|imgdata.img> ...]\n", prog);
+	printf("       %s -D <patch> [-v] <old.img> <new.img>\n", prog);
+	printf("       %s -A <patch> <old.img|partition> <new.img>\n", prog);
+}
+
+int main(int argc, char **argv) {
+	int opt, ret, mapped, timing = 0, batch = 0, index = 0, apply = 0;
+	long jobs;
+	unpack_opts opts = {0, 0, 1, AT_FDCWD, -1, NULL, 0};
+	copy_stats stats = {0, 0, 0, 0};
+	struct timeval start, end;
+	char *outdir = ".", *dumpdir = NULL, *patch = NULL, **files = NULL, *last;
+	unsigned int i, count = 0;
+
+	while ((opt = getopt(argc, argv, "vstj:bJo:f:d:p:P:V:D:A:")) != -1) {
+		switch (opt) {
+			case 'v':
+				opts.verbose = 1;
+				break;
+			case 's':
+				opts.stream = 1;
+				break;
+			case 't':
+				timing = 1;
+				break;
+			case 'j':
+				jobs = strtol(optarg, &last, 0);
+				if (*optarg == '\0' || *last != '\0' || jobs < 1 || jobs > MAX_JOBS) {
+					fprintf(stderr, "Invalid number of jobs %s, use 1 to %d\n", optarg, MAX_JOBS);
+					return EXIT_FAILURE;
+				}
+				opts.jobs = (unsigned int) jobs;
+				break;
+			case 'b':
+				batch = 1;
+				break;
+			case 'J':
+				batch = 1;
+				index = 1;
+				break;
+			case 'o':
+				outdir = optarg;
+				break;
+			case 'd':
+				if ((mkdir(optarg, 0777) && errno != EEXIST) || (opts.storefd = open(optarg, O_RDONLY | O_DIRECTORY)) < 0) {
+					fprintf(stderr, "Error opening store %s: %s\n", optarg, strerror(errno));
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'p':
+				if (parse_ptable(optarg, &opts) == EXIT_FAILURE) {
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'P':
+				if (read_ptable(optarg, &opts) == EXIT_FAILURE) {
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'V':
+				dumpdir = optarg;
+				break;
+			case 'A':
+				apply = 1;
+				/* fall through */
+			case 'D':
+				patch = optarg;
+				break;
+			case 'f':
+				if (read_file_list(optarg, &files, &count) == EXIT_FAILURE) {
+					return EXIT_FAILURE;
+				}
+				break;
+			default:
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (batch) {
+		for (; optind < argc; ++optind) {
+			char **grown = realloc(files, (count + 1) * sizeof(char *));
+			if (grown == NULL || !(grown[count] = strdup(argv[optind]))) {
+				return EXIT_FAILURE;
+			}
+			files = grown;
+			++count;
+		}
+		if (count == 0) {
+			print_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		ret = unpack_batch(files, count, outdir, opts.jobs, &opts, index);
+		for (i = 0; i < count; ++i) {
+			free(files[i]);
+		}
+		free(files);
+		return ret;
+	}
+
+	if (patch != NULL) {
+		if (optind != argc - 2 || files != NULL) {
+			print_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		return apply ? apply_patch(patch, argv[optind], argv[optind + 1]) : diff_files(patch, argv[optind], argv[optind + 1], opts.verbose);
+	}
+
+	if (optind != argc - 1 || files != NULL) {
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (dumpdir != NULL) {
+		return verify_file(argv[optind], dumpdir, &opts);
+	}
+
+	gettimeofday(&start, NULL);
+	ret = unpack_file(argv[optind], &opts, &stats, &mapped);
+	gettimeofday(&end, NULL);
+
+	if (timing) {
+		fprintf(stderr, "%s: %llu bytes written, %llu bytes already stored, %llu bytes copied through user space, %.6f s"
+			" (header checks %.6f s)\n", mapped ? "mmap" : "stream", stats.written, stats.deduped, stats.copied,
+			elapsed(&start, &end), stats.checked);
+	}
+
+	return ret;
+}
@@ -5,7 +5,7 @@
 # Version: 20140502
 # Description: Dumps the contents of the flashchip or partition of an Android device.
 #              Only tested on hammerhead (LG Nexus 5 Android 4.4)
-# Instructions: needed binaries: adb, fastboot, netstat (, pv, nc (, gzip))
+# Instructions: needed binaries: adb, fastboot, netstat (, pv, nc (, gzip)) (, xfer)
 # Usage: $0 <config-file> <output imagefile> <forwarding-port> [device-serial]
 
 tooldir=$(dirname "$0")
@@ -56,8 +56,12 @@ prtprog="$(netstat -anp 2>/dev/null | grep ":$port.*LISTEN" | cut -d'/' -f2)"
 [[ -z "$devdump" ]] && echo "No blockdevice or partition specified to dump, check config." && exit 2
 # Verify recovery image exists and the method used
 ( [[ -z "$recfile" ]] || [[ ! -f "$recfile" ]] ) && echo "Could not find recoveryimage $recfile, check config" && exit 2
-( [[ -z "$recmethod" ]] || [[ ! "$recmethod" =~ ^(simple|feedback|compressed)$ ]] ) &&
- echo "Could not find a valid dump method: $recmethod not one of simple, feedback or compressed. Check config." && exit 2
+( [[ -z "$recmethod" ]] || [[ ! "$recmethod" =~ ^(simple|feedback|compressed|chunked)$ ]] ) &&
+ echo "Could not find a valid dump method: $recmethod not one of simple, feedback, compressed or chunked. Check config." && exit 2
+# The chunked method needs xfer built for both sides
+[[ "$recmethod" == "chunked" ]] && ( [[ ! -x "$xfer" ]] || [[ ! -f "$xferdev" ]] ) &&
+ echo "Could not find xfer binaries $xfer and $xferdev, needed for the chunked method. Check config." && exit 2
+[[ -z "$xferconns" ]] && xferconns=4
 
 # Check if device is off, in normal mode or in fastboot
 status="unauthorized"
@@ -148,10 +152,27 @@ dump_compressed() {
   nc 127.0.0.1 $port | pv | gunzip -c > "$output"
 }
 
+dump_chunked() {
+  # Prepare for dump: forward a port per connection
+  for ((i = 0; i < $xferconns; i++)); do
+    "$adb" -s $serial forward tcp:$(($port + $i)) tcp:$(($port + $i))
+  done
+
+  # Chunks are sent in parallel, each compressed and checked on its own,
+  # a failed dump resumes from $output.chunks when run again
+  "$adb" -s $serial push "$xferdev" /tmp/xfer
+  "$adb" -s $serial shell "chmod 755 /tmp/xfer && /tmp/xfer -s -p $port -n $xferconns $devdump" 2>/dev/null &
+  echo "Waiting for transfer to start..."
+  sleep 2
+  "$xfer" -g -p $port -n $xferconns "$output" || exit 2
+}
+
 if [[ "$recmethod" == "simple" ]]; then
   dump_simple
 elif [[ "$recmethod" == "compressed" ]]; then
   dump_compressed
+elif [[ "$recmethod" == "chunked" ]]; then
+  dump_chunked
 else
   # with feedback
   dump_w_output
@@ -0,0 +1,47 @@
+/*
+ * Initially developed at Ghent University as part of a masters thesis promoted
+ * by prof. dr. ir. Bjorn De Sutter of the Computer Systems Lab in cooperation with ir. Daan Raman from NVISO.
+ * Description: libFuzzer harness for the bootloader.img header checks of bunp: the input is parsed
+ *              as a mapped file with parse_header(), which runs check_header() and check_images(),
+ *              and as a pipe with read_header(). An accepted table must lie inside the input.
+ *              bootloader_unpacker.c is included as a whole, its main() renamed
+ * Instructions: clang -g -O1 -fsanitize=fuzzer,address,undefined -o fuzz_bootldr fuzz_bootldr.c -lpthread
+ * Usage: $0 [libFuzzer options] [corpus dir]
+ *        a bootloader.img cut to its header is a good start for the corpus:
+ *           mkdir corpus && head -c 4096 bootloader.img > corpus/hdr && ./fuzz_bootldr corpus
+ */
+
+#define main bunp_main
+#include "../bootloader_unpacker.c"
+#undef main
+
+#include <stdint.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	bootldrimgh bimg;
+	img_info *imgs;
+	unsigned long long end;
+	unsigned int i;
+	FILE *in;
+
+	if (parse_header(data, size, &bimg, &imgs) == EXIT_SUCCESS) {
+		end = bimg.start_offset;
+		for (i = 0; i < bimg.num_images; ++i) {
+			end += imgs[i].size;
+		}
+		if (end > size) {
+			abort();
+		}
+		free(imgs);
+	}
+
+	/* fmemopen refuses an empty buffer */
+	if (size > 0 && (in = fmemopen((void *) data, size, "rb")) != NULL) {
+		if (read_header(in, &bimg, &imgs) == EXIT_SUCCESS) {
+			free(imgs);
+		}
+		fclose(in);
+	}
+
+	return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Initially developed at Ghent University as part of a masters thesis promoted
+ * by prof. dr. ir. Bjorn De Sutter of the Computer Systems Lab in cooperation with ir. Daan Raman from NVISO.
+ * Description: libFuzzer harness for the imgdata.img reader: the input is opened with imgdata_open_mem()
+ *              and every content that passes imgdata_runs() is decoded with decode_rows(), which
+ *              has to hand over exactly imgheight rows
+ * Instructions: clang -g -O1 -fsanitize=fuzzer,address,undefined -o fuzz_imgdata fuzz_imgdata.c ../imgdata.c
+ * Usage: $0 [libFuzzer options] [corpus dir]
+ *        an imgdata.img (e.g. from bunp) is a good start for the corpus:
+ *           mkdir corpus && cp imgdata.img corpus/ && ./fuzz_imgdata -max_len=65536 corpus
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "../imgdata.h"
+
+/*
+ * Counts the rows decode_rows hands over
+ */
+int count_row(void *data, unsigned char *row) {
+	(void) row;
+	++*(unsigned int *) data;
+	return EXIT_SUCCESS;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	imgdata img;
+	pixelrun *buf;
+	unsigned char *row;
+	unsigned int i, nruns, rows;
+
+	if (imgdata_open_mem(data, size, &img) == EXIT_FAILURE) {
+		return 0;
+	}
+
+	for (i = 0; i < img.hdr.num_files; ++i) {
+		if ((buf = imgdata_runs(&img, i, &nruns)) == NULL) {
+			continue;
+		}
+		/* checked contents are at most IMGDATA_MAX_DIMENSION wide */
+		if ((row = malloc((size_t) img.files[i].imgwidth * 3 + 1)) == NULL) {
+			break;
+		}
+		rows = 0;
+		decode_rows(buf, nruns, img.files[i].imgwidth, row, expand_run, count_row, &rows);
+		if (img.files[i].imgwidth > 0 && rows != img.files[i].imgheight) {
+			abort();
+		}
+		free(row);
+	}
+
+	imgdata_close(&img);
+	return 0;
+}
@@ -5,7 +5,7 @@
 # Version: 20140507
 # Description: Writes the contents of an image to the flashchip of an Android device.
 #              Only tested on hammerhead (LG Nexus 5 Android 4.4)
-# Instructions: needed binaries: adb, fastboot, netstat (, nc (, gzip))
+# Instructions: needed binaries: adb, fastboot, netstat (, nc (, gzip)) (, xfer) (, bunp)
 # Usage: $0 <config-file> <input imagefile> <forwarding-port> [device-serial]
 
 tooldir=$(dirname "$0")
@@ -48,8 +48,17 @@ prtprog="$(netstat -anp 2>/dev/null | grep ":$port.*LISTEN" | cut -d'/' -f2)"
 [[ -z "$devdump" ]] && echo "No blockdevice or partition specified to write to, check config." && exit 2
 # Verify recovery image exists and the method used
 ( [[ -z "$recfile" ]] || [[ ! -f "$recfile" ]] ) && echo "Could not find recoveryimage $recfile, check config" && exit 2
-( [[ -z "$recmethod" ]] || [[ ! "$recmethod" =~ ^(simple|feedback|compressed)$ ]] ) &&
- echo "Could not find a valid write method: $recmethod not one of simple, feedback or compressed. Check config." && exit 2
+( [[ -z "$recmethod" ]] || [[ ! "$recmethod" =~ ^(simple|feedback|compressed|chunked|patch)$ ]] ) &&
+ echo "Could not find a valid write method: $recmethod not one of simple, feedback, compressed, chunked or patch. Check config." && exit 2
+# The chunked method needs xfer built for both sides
+[[ "$recmethod" == "chunked" ]] && ( [[ ! -x "$xfer" ]] || [[ ! -f "$xferdev" ]] ) &&
+ echo "Could not find xfer binaries $xfer and $xferdev, needed for the chunked method. Check config." && exit 2
+[[ -z "$xferconns" ]] && xferconns=4
+# The patch method needs bunp built for both sides and the image now on the device
+[[ "$recmethod" == "patch" ]] && ( [[ ! -x "$bunp" ]] || [[ ! -f "$bunpdev" ]] ) &&
+ echo "Could not find bunp binaries $bunp and $bunpdev, needed for the patch method. Check config." && exit 2
+[[ "$recmethod" == "patch" ]] && [[ ! -f "$patchbase" ]] &&
+ echo "Could not find $patchbase, the image on the device to patch. Check config." && exit 2
 
 # Check if device is off, in normal mode or in fastboot
 status="unauthorized"
@@ -140,10 +149,41 @@ write_compressed() {
   gzip -c "$input" | nc -x 127.0.0.1 $port
 }
 
+write_chunked() {
+  # Prepare for write: forward a port per connection
+  for ((i = 0; i < $xferconns; i++)); do
+    "$adb" -s $serial forward tcp:$(($port + $i)) tcp:$(($port + $i))
+  done
+
+  # Chunks are sent in parallel, each compressed and checked on its own,
+  # a failed write resumes from $input.chunks when run again
+  "$adb" -s $serial push "$xferdev" /tmp/xfer
+  "$adb" -s $serial shell "chmod 755 /tmp/xfer && /tmp/xfer -s -w -p $port -n $xferconns $devdump" 2>/dev/null &
+  echo "Waiting for transfer to start..."
+  sleep 2
+  "$xfer" -u -p $port -n $xferconns "$input" || exit 2
+}
+
+write_patch() {
+  # Only what changed since $patchbase is sent, the device rebuilds the image from its own
+  # partition and only writes it when the SHA-256 is that of $input
+  "$bunp" -D "$input.patch" "$patchbase" "$input" || exit 2
+  "$adb" -s $serial push "$bunpdev" /tmp/bunp
+  "$adb" -s $serial push "$input.patch" /tmp/image.patch
+  result="$("$adb" -s $serial shell "chmod 755 /tmp/bunp && /tmp/bunp -A /tmp/image.patch $devdump /tmp/image.new &&
+    /sbin/busybox dd if=/tmp/image.new of=$devdump status=noxfer && echo Patched")"
+  echo "$result"
+  [[ "$result" != *Patched* ]] && echo "Patch did not apply, is $patchbase what the device holds?" && exit 2
+}
+
 if [[ "$recmethod" == "simple" ]]; then
   write_simple
 elif [[ "$recmethod" == "compressed" ]]; then
   write_compressed
+elif [[ "$recmethod" == "chunked" ]]; then
+  write_chunked
+elif [[ "$recmethod" == "patch" ]]; then
+  write_patch
 else
   # with feedback
   write_w_output
@@ -0,0 +1,810 @@
+/*
+ * Initially developed at Ghent University as part of a masters thesis promoted
+ * by prof. dr. ir. Bjorn De Sutter of the Computer Systems Lab in cooperation with ir. Daan Raman from NVISO.
+ * Description: Chunked parallel transfer of a partition over adb forwarded ports, used by the
+ *              chunked recmethod of dumper.sh and writer.sh
+ *              The partition is split in chunks which are sent zlib compressed with a crc32 each
+ *              over several connections at once and written at their offset, a journal of the
+ *              chunks done makes a failed transfer resume where it stopped when run again
+ * Instructions: gcc -o xfer xfer.c -lz -lpthread
+ *               for the device side a static ARM build, e.g.
+ *               arm-linux-gnueabihf-gcc -static -o xfer.arm xfer.c -lz -lpthread
+ * Usage: $0 -s [-w] -p <port> [-n N] <partition>
+ *        $0 -g -p <port> [-n N] [-c bytes] [-z level] [-J <journal>] <output imagefile>
+ *        $0 -u -p <port> [-n N] [-c bytes] [-z level] [-J <journal>] <input imagefile>
+ *           -s : serve <partition> on ports <port> up to <port>+N-1 of localhost (device side)
+ *           -w : with -s, allow writing <partition>
+ *           -g : get the served partition into <output imagefile> (host side, dumping)
+ *           -u : put <input imagefile> on the served partition (host side, writing)
+ *           -n N : connections at the same time, default 4, the same for both sides
+ *           -c bytes : chunk size, default 1MiB
+ *           -z level : zlib level 0-9, default 1
+ *           -J <journal> : chunks done so far, default <imagefile>.chunks, removed when all are done
+ *        Both sides can run on one host to test without a device:
+ *           ./xfer -s -p 5555 part.img & ./xfer -g -p 5555 copy.img
+ */
+
+#define _FILE_OFFSET_BITS 64 /* partitions over 2GiB with the 32bit ARM build */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "../lecodec.h"
+
+#define XFER_CHUNK_SIZE 1048576 /* default bytes per chunk */
+#define XFER_MAX_CHUNK 16777216 /* larger chunks are refused, buffers are allocated by chunk size */
+#define XFER_MAX_CONNS 16
+#define XFER_RETRIES 3 /* attempts per chunk before giving up on it until the next run */
+#define XFER_TIMEOUT 30 /* seconds without data before a connection is taken as failed */
+#define XFER_JOURNAL_MAGIC "XFERJRN!"
+#define XFER_JOURNAL_MAGIC_SIZE 8 /* No room for terminating \0 */
+
+/* requests, replies carry XFER_OK or XFER_ERROR in op */
+#define XFER_OK 0
+#define XFER_ERROR 1
+#define XFER_SIZE 2 /* reply: offset is the partition size, size is 1 if it can't grow */
+#define XFER_GET 3 /* request: offset, size and zlib level in csize, reply: offset, size, csize, crc and data */
+#define XFER_PUT 4 /* request: offset, size, csize, crc and data */
+#define XFER_DONE 5 /* everything is sent, the server syncs and quits */
+
+/* message on the wire, unsigned int are in little endian, see lecodec.h */
+#define XFER_MSG_FIELDS(U32, BYTES) \
+	U32(op) \
+	U32(offset_lo) \
+	U32(offset_hi) \
+	U32(size) \
+	U32(csize) /* compressed size of the data following, equal to size if not compressed */ \
+	U32(crc) /* crc32 of the uncompressed data */
+
+/* start of a journal, followed by a byte per chunk, 1 if done */
+#define XFER_JOURNAL_FIELDS(U32, BYTES) \
+	BYTES(magic, XFER_JOURNAL_MAGIC_SIZE) \
+	U32(size_lo) \
+	U32(size_hi) \
+	U32(chunk)
+
+typedef struct {
+	LECODEC_STRUCT(XFER_MSG_FIELDS)
+} xfer_msg;
+
+typedef struct {
+	LECODEC_STRUCT(XFER_JOURNAL_FIELDS)
+} xfer_journal;
+
+LECODEC(xfer_msg, XFER_MSG_FIELDS)
+LECODEC(xfer_journal, XFER_JOURNAL_FIELDS)
+
+/* a served partition, shared by the listener of every port */
+typedef struct {
+	int fd;
+	int writable;
+	unsigned long long size;
+	int fixed; /* not a regular file, so it can't grow */
+	int port;
+} xfer_server;
+
+/* state of a -g or -u transfer, shared by the connection workers */
+typedef struct {
+	int fd; /* local imagefile */
+	int journalfd;
+	int put;
+	int level;
+	int port;
+	unsigned long long size;
+	unsigned int chunk;
+	unsigned int nchunks;
+	unsigned char *done; /* per chunk, guarded by lock */
+	unsigned int next; /* next chunk to look at, guarded by lock */
+	unsigned int failed; /* guarded by lock */
+	unsigned long long moved; /* bytes of the chunks done this run, guarded by lock */
+	unsigned long long wire; /* bytes of chunk data sent over the connections, guarded by lock */
+	pthread_mutex_t lock;
+} xfer_job;
+
+/* a connection worker of a transfer */
+typedef struct {
+	xfer_job *job;
+	int port;
+} xfer_worker;
+
+/*
+ * Reads exactly len bytes from fd
+ * Returns EXIT_FAILURE on errors, timeouts or end of stream
+ */
+int read_all(int fd, void *buf, size_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return EXIT_FAILURE;
+		}
+		buf = (char *) buf + n;
+		len -= n;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Writes exactly len bytes to fd
+ * Returns EXIT_FAILURE on errors
+ */
+int write_all(int fd, const void *buf, size_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return EXIT_FAILURE;
+		}
+		buf = (const char *) buf + n;
+		len -= n;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Positioned versions of the above, for the chunks of a file
+ */
+int pread_all(int fd, void *buf, size_t len, off_t offset) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, buf, len, offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return EXIT_FAILURE;
+		}
+		buf = (char *) buf + n;
+		len -= n;
+		offset += n;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return EXIT_FAILURE;
+		}
+		buf = (const char *) buf + n;
+		len -= n;
+		offset += n;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int send_msg(int fd, xfer_msg *msg) {
+	unsigned char raw[xfer_msg_size];
+
+	xfer_msg_encode(raw, msg);
+	return write_all(fd, raw, sizeof(raw));
+}
+
+int recv_msg(int fd, xfer_msg *msg) {
+	unsigned char raw[xfer_msg_size];
+
+	if (read_all(fd, raw, sizeof(raw)) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	xfer_msg_decode(msg, raw);
+	return EXIT_SUCCESS;
+}
+
+unsigned long long msg_offset(xfer_msg *msg) {
+	return (unsigned long long) msg->offset_hi << 32 | msg->offset_lo;
+}
+
+void set_offset(xfer_msg *msg, unsigned long long offset) {
+	msg->offset_lo = offset;
+	msg->offset_hi = offset >> 32;
+}
+
+/*
+ * Compresses size bytes of raw into cbuf (compressBound(XFER_MAX_CHUNK) bytes), filling in
+ * size, csize and crc of msg
+ * Returns the data to send, cbuf or raw itself if compressing doesn't make it smaller
+ */
+unsigned char *pack_chunk(unsigned char *raw, unsigned int size, unsigned char *cbuf, int level, xfer_msg *msg) {
+	uLongf clen = compressBound(XFER_MAX_CHUNK);
+
+	msg->size = size;
+	msg->crc = crc32(crc32(0L, Z_NULL, 0), raw, size);
+	if (level > 0 && compress2(cbuf, &clen, raw, size, level) == Z_OK && clen < size) {
+		msg->csize = clen;
+		return cbuf;
+	}
+	msg->csize = size;
+	return raw;
+}
+
+/*
+ * Reads the data of msg from fd into raw, uncompressing it through cbuf, and checks its crc
+ * Returns EXIT_FAILURE if the connection failed, with *bad set if only the data was wrong
+ */
+int unpack_chunk(int fd, xfer_msg *msg, unsigned char *raw, unsigned char *cbuf, int *bad) {
+	uLongf len = msg->size;
+
+	*bad = 0;
+	if (msg->size > XFER_MAX_CHUNK || msg->csize > msg->size) {
+		return EXIT_FAILURE;
+	}
+	if (read_all(fd, msg->csize < msg->size ? cbuf : raw, msg->csize) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	if (msg->csize < msg->size && (uncompress(raw, &len, cbuf, msg->csize) != Z_OK || len != msg->size)) {
+		*bad = 1;
+		return EXIT_FAILURE;
+	}
+	if (crc32(crc32(0L, Z_NULL, 0), raw, msg->size) != msg->crc) {
+		*bad = 1;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Handles the requests of one connection until it closes
+ */
+void serve_conn(int sock, xfer_server *srv, unsigned char *raw, unsigned char *cbuf) {
+	xfer_msg msg, reply;
+	unsigned char *data;
+	unsigned long long offset;
+	int bad;
+
+	while (recv_msg(sock, &msg) == EXIT_SUCCESS) {
+		memset(&reply, 0, sizeof(reply));
+		offset = msg_offset(&msg);
+		switch (msg.op) {
+			case XFER_SIZE:
+				set_offset(&reply, srv->size);
+				reply.size = srv->fixed;
+				if (send_msg(sock, &reply) == EXIT_FAILURE) {
+					return;
+				}
+				break;
+			case XFER_GET:
+				if (msg.size > XFER_MAX_CHUNK || offset > srv->size || msg.size > srv->size - offset ||
+						pread_all(srv->fd, raw, msg.size, offset) == EXIT_FAILURE) {
+					reply.op = XFER_ERROR;
+					if (send_msg(sock, &reply) == EXIT_FAILURE) {
+						return;
+					}
+					break;
+				}
+				set_offset(&reply, offset);
+				data = pack_chunk(raw, msg.size, cbuf, msg.csize, &reply);
+				if (send_msg(sock, &reply) == EXIT_FAILURE || write_all(sock, data, reply.csize) == EXIT_FAILURE) {
+					return;
+				}
+				break;
+			case XFER_PUT:
+				/* the data has to be read even if it's refused, to stay in step with the client */
+				if (unpack_chunk(sock, &msg, raw, cbuf, &bad) == EXIT_FAILURE && !bad) {
+					return;
+				}
+				if (bad || !srv->writable || (srv->fixed && (offset > srv->size || msg.size > srv->size - offset)) ||
+						pwrite_all(srv->fd, raw, msg.size, offset) == EXIT_FAILURE) {
+					reply.op = XFER_ERROR;
+				}
+				if (send_msg(sock, &reply) == EXIT_FAILURE) {
+					return;
+				}
+				break;
+			case XFER_DONE:
+				if (srv->writable) {
+					fsync(srv->fd);
+				}
+				send_msg(sock, &reply);
+				exit(EXIT_SUCCESS);
+			default:
+				return;
+		}
+	}
+}
+
+/*
+ * Listener of one port, serves its connections one after the other
+ * A connection that breaks off is simply opened again by the client
+ */
+void *serve_port(void *data) {
+	xfer_server *srv = data;
+	struct sockaddr_in addr;
+	unsigned char *raw, *cbuf;
+	int lsock, sock, one = 1;
+
+	raw = malloc(XFER_MAX_CHUNK);
+	cbuf = malloc(compressBound(XFER_MAX_CHUNK));
+	if ((lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0 || raw == NULL || cbuf == NULL) {
+		perror("Error setting up listener");
+		exit(EXIT_FAILURE);
+	}
+	setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	/* adb forwards to localhost on the device, nothing else needs to reach us */
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(srv->port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(lsock, (struct sockaddr *) &addr, sizeof(addr)) || listen(lsock, 1)) {
+		fprintf(stderr, "Error listening on port %d: %s\n", srv->port, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	while (1) {
+		if ((sock = accept(lsock, NULL, NULL)) < 0) {
+			continue;
+		}
+		serve_conn(sock, srv, raw, cbuf);
+		close(sock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Serves path on conns ports starting at port until a client is done (-s)
+ */
+int serve(const char *path, int port, unsigned int conns, int writable) {
+	xfer_server srv[XFER_MAX_CONNS];
+	pthread_t threads[XFER_MAX_CONNS];
+	struct stat st;
+	off_t end;
+	unsigned int i;
+	int fd;
+
+	if ((fd = open(path, writable ? O_RDWR : O_RDONLY)) < 0 || fstat(fd, &st)) {
+		perror("Error opening partition");
+		return EXIT_FAILURE;
+	}
+	/* block devices report their size through lseek only */
+	if ((end = lseek(fd, 0, SEEK_END)) < 0) {
+		perror("Error getting partition size");
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < conns; ++i) {
+		srv[i].fd = fd;
+		srv[i].writable = writable;
+		srv[i].size = end;
+		srv[i].fixed = !S_ISREG(st.st_mode);
+		srv[i].port = port + i;
+	}
+	for (i = 1; i < conns; ++i) {
+		if (pthread_create(&threads[i], NULL, serve_port, &srv[i])) {
+			perror("Error starting listener");
+			return EXIT_FAILURE;
+		}
+	}
+	serve_port(&srv[0]);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Connects to port on localhost, where adb forwards it to the device
+ * Returns the socket or -1
+ */
+int connect_port(int port) {
+	struct sockaddr_in addr;
+	struct timeval timeout = {XFER_TIMEOUT, 0};
+	int sock;
+
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/*
+ * Transfers chunk i of job over sock in the direction of the job
+ * Returns EXIT_FAILURE if it has to be tried again, with *broken set if sock can't be used anymore
+ */
+int transfer_chunk(int sock, xfer_job *job, unsigned int i, unsigned char *raw, unsigned char *cbuf, int *broken) {
+	unsigned long long offset = (unsigned long long) i * job->chunk;
+	unsigned int size = job->size - offset < job->chunk ? job->size - offset : job->chunk;
+	xfer_msg msg, reply;
+	unsigned char *data;
+	int bad = 0;
+
+	*broken = 1;
+	memset(&msg, 0, sizeof(msg));
+	set_offset(&msg, offset);
+	if (job->put) {
+		msg.op = XFER_PUT;
+		if (pread_all(job->fd, raw, size, offset) == EXIT_FAILURE) {
+			*broken = 0;
+			return EXIT_FAILURE;
+		}
+		data = pack_chunk(raw, size, cbuf, job->level, &msg);
+		if (send_msg(sock, &msg) == EXIT_FAILURE || write_all(sock, data, msg.csize) == EXIT_FAILURE ||
+				recv_msg(sock, &reply) == EXIT_FAILURE) {
+			return EXIT_FAILURE;
+		}
+		*broken = 0;
+		if (reply.op != XFER_OK) {
+			return EXIT_FAILURE;
+		}
+	} else {
+		msg.op = XFER_GET;
+		msg.size = size;
+		msg.csize = job->level;
+		if (send_msg(sock, &msg) == EXIT_FAILURE || recv_msg(sock, &reply) == EXIT_FAILURE) {
+			return EXIT_FAILURE;
+		}
+		if (reply.op != XFER_OK) {
+			*broken = 0;
+			return EXIT_FAILURE;
+		}
+		if (reply.size != size || msg_offset(&reply) != offset ||
+				unpack_chunk(sock, &reply, raw, cbuf, &bad) == EXIT_FAILURE) {
+			/* a bad crc leaves the stream in step, anything else doesn't */
+			*broken = !bad;
+			return EXIT_FAILURE;
+		}
+		*broken = 0;
+		if (pwrite_all(job->fd, raw, size, offset) == EXIT_FAILURE) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	pthread_mutex_lock(&job->lock);
+	job->moved += size;
+	job->wire += job->put ? msg.csize : reply.csize;
+	pthread_mutex_unlock(&job->lock);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Worker of one connection, transfers chunks not yet done until none are left
+ * A chunk is marked in the journal only after it has been written
+ */
+void *transfer_worker(void *data) {
+	xfer_worker *w = data;
+	xfer_job *job = w->job;
+	unsigned char *raw, *cbuf, one = 1;
+	unsigned int i, attempt;
+	int sock = -1, broken, ok;
+
+	raw = malloc(job->chunk);
+	cbuf = malloc(compressBound(XFER_MAX_CHUNK));
+	if (raw == NULL || cbuf == NULL) {
+		free(raw);
+		free(cbuf);
+		return NULL;
+	}
+
+	while (1) {
+		pthread_mutex_lock(&job->lock);
+		while (job->next < job->nchunks && job->done[job->next]) {
+			++job->next;
+		}
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->nchunks) {
+			break;
+		}
+
+		for (ok = 0, attempt = 0; !ok && attempt < XFER_RETRIES; ++attempt) {
+			if (sock < 0 && (sock = connect_port(w->port)) < 0) {
+				sleep(1);
+				continue;
+			}
+			ok = transfer_chunk(sock, job, i, raw, cbuf, &broken) == EXIT_SUCCESS;
+			if (!ok && broken) {
+				close(sock);
+				sock = -1;
+			}
+		}
+
+		pthread_mutex_lock(&job->lock);
+		if (ok) {
+			job->done[i] = 1;
+			if (job->journalfd >= 0) {
+				pwrite_all(job->journalfd, &one, 1, xfer_journal_size + i);
+			}
+		} else {
+			++job->failed;
+		}
+		pthread_mutex_unlock(&job->lock);
+		/* without a connection every further chunk would just wait out its retries */
+		if (!ok && sock < 0) {
+			break;
+		}
+	}
+
+	if (sock >= 0) close(sock);
+	free(raw);
+	free(cbuf);
+	return NULL;
+}
+
+/*
+ * Opens the journal at path and loads the chunks done from it, if it belongs to the same
+ * size and chunk size, else starts a new one
+ * Returns EXIT_FAILURE if it can't be written
+ */
+int open_journal(const char *path, xfer_job *job) {
+	unsigned char raw[xfer_journal_size];
+	xfer_journal hdr;
+	unsigned int i, resumed = 0;
+
+	if ((job->journalfd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+		fprintf(stderr, "Error opening journal %s: %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (pread_all(job->journalfd, raw, sizeof(raw), 0) == EXIT_SUCCESS) {
+		xfer_journal_decode(&hdr, raw);
+		if (!strncmp(hdr.magic, XFER_JOURNAL_MAGIC, XFER_JOURNAL_MAGIC_SIZE) && hdr.chunk == job->chunk &&
+				((unsigned long long) hdr.size_hi << 32 | hdr.size_lo) == job->size) {
+			pread_all(job->journalfd, job->done, job->nchunks, sizeof(raw));
+			for (i = 0; i < job->nchunks; ++i) {
+				resumed += job->done[i] = job->done[i] == 1;
+			}
+			if (resumed > 0) {
+				printf("Resuming, %u of %u chunks already done.\n", resumed, job->nchunks);
+			}
+			return EXIT_SUCCESS;
+		}
+	}
+
+	memcpy(hdr.magic, XFER_JOURNAL_MAGIC, XFER_JOURNAL_MAGIC_SIZE);
+	hdr.size_lo = job->size;
+	hdr.size_hi = job->size >> 32;
+	hdr.chunk = job->chunk;
+	xfer_journal_encode(raw, &hdr);
+	if (ftruncate(job->journalfd, 0) || pwrite_all(job->journalfd, raw, sizeof(raw), 0) == EXIT_FAILURE ||
+			ftruncate(job->journalfd, sizeof(raw) + job->nchunks)) {
+		fprintf(stderr, "Error writing journal %s: %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Sends op over a new connection to port and waits for the reply
+ * Returns EXIT_FAILURE if no XFER_OK came back
+ */
+int request(int port, unsigned int op, xfer_msg *reply) {
+	xfer_msg msg;
+	int sock, ret;
+
+	if ((sock = connect_port(port)) < 0) {
+		return EXIT_FAILURE;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.op = op;
+	ret = send_msg(sock, &msg) == EXIT_SUCCESS && recv_msg(sock, reply) == EXIT_SUCCESS && reply->op == XFER_OK;
+	close(sock);
+
+	return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Gets (-g) the served partition into path or puts (-u) path on it
+ */
+int transfer(const char *path, const char *journal, int port, unsigned int conns, unsigned int chunk, int level, int put) {
+	xfer_worker workers[XFER_MAX_CONNS];
+	pthread_t threads[XFER_MAX_CONNS];
+	char jpath[4096];
+	struct timeval start, end;
+	struct stat st;
+	xfer_job job;
+	xfer_msg reply;
+	unsigned long long remote;
+	unsigned int i, started, left;
+	double secs;
+	int ret = EXIT_FAILURE;
+
+	memset(&job, 0, sizeof(job));
+	job.put = put;
+	job.level = level;
+	job.port = port;
+	job.chunk = chunk;
+	job.journalfd = -1;
+
+	/* the server may still be starting up on the device */
+	for (i = 0; i < 5 && request(port, XFER_SIZE, &reply) == EXIT_FAILURE; ++i) {
+		sleep(1);
+	}
+	if (i == 5) {
+		fprintf(stderr, "Error connecting to port %d\n", port);
+		return EXIT_FAILURE;
+	}
+	remote = msg_offset(&reply);
+
+	if ((job.fd = open(path, put ? O_RDONLY : O_RDWR | O_CREAT, 0644)) < 0 || fstat(job.fd, &st)) {
+		perror("Error opening imagefile");
+		return EXIT_FAILURE;
+	}
+	job.size = put ? (unsigned long long) st.st_size : remote;
+	if (put && reply.size && job.size > remote) {
+		fprintf(stderr, "Error: %s is %llu bytes, the partition only %llu\n", path, job.size, remote);
+		close(job.fd);
+		return EXIT_FAILURE;
+	}
+	job.nchunks = (job.size + chunk - 1) / chunk;
+	if ((job.done = calloc(job.nchunks + 1, 1)) == NULL) {
+		close(job.fd);
+		return EXIT_FAILURE;
+	}
+
+	if (journal == NULL) {
+		snprintf(jpath, sizeof(jpath), "%s.chunks", path);
+		journal = jpath;
+	}
+	if (open_journal(journal, &job) == EXIT_FAILURE) {
+		goto out;
+	}
+	if (!put && S_ISREG(st.st_mode) && ftruncate(job.fd, job.size)) {
+		perror("Error sizing output");
+		goto out;
+	}
+
+	gettimeofday(&start, NULL);
+	pthread_mutex_init(&job.lock, NULL);
+	for (started = 0; started < conns; ++started) {
+		workers[started].job = &job;
+		workers[started].port = port + started;
+		if (pthread_create(&threads[started], NULL, transfer_worker, &workers[started])) {
+			break;
+		}
+	}
+	if (started == 0) {
+		transfer_worker(&workers[0]);
+	}
+	for (i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&job.lock);
+	gettimeofday(&end, NULL);
+
+	secs = end.tv_sec - start.tv_sec + (end.tv_usec - start.tv_usec) / 1e6;
+	printf("%llu of %llu bytes in %u chunks, %llu over the wire, %.2fs (%.1f MiB/s)\n", job.moved, job.size, job.nchunks,
+		job.wire, secs, secs > 0 ? job.moved / 1048576.0 / secs : 0);
+	fflush(stdout);
+
+	for (i = 0, left = 0; i < job.nchunks; ++i) {
+		left += !job.done[i];
+	}
+	if (left > 0) {
+		fprintf(stderr, "%u chunks failed, run again with the same arguments to resume.\n", left);
+		goto out;
+	}
+	if (request(port, XFER_DONE, &reply) == EXIT_FAILURE) {
+		fprintf(stderr, "Error finishing transfer, the partition may not be synced.\n");
+		goto out;
+	}
+	if (!put && fsync(job.fd)) {
+		perror("Error syncing output");
+		goto out;
+	}
+	unlink(journal);
+	ret = EXIT_SUCCESS;
+
+out:
+	if (job.journalfd >= 0) close(job.journalfd);
+	free(job.done);
+	close(job.fd);
+	return ret;
+}
+
+void print_usage(const char *prog) {
+	printf("Usage: %s -s [-w] -p <port> [-n N] <partition>\n", prog);
+	printf("       %s -g -p <port> [-n N] [-c bytes] [-z level] [-J <journal>] <output imagefile>\n", prog);
+	printf("       %s -u -p <port> [-n N] [-c bytes] [-z level] [-J <journal>] <input imagefile>\n", prog);
+}
+
+int main(int argc, char **argv) {
+	char *journal = NULL, *end;
+	unsigned long val;
+	unsigned int conns = 4, chunk = XFER_CHUNK_SIZE;
+	int opt, mode = 0, writable = 0, port = 0, level = 1;
+
+	while ((opt = getopt(argc, argv, "sgwup:n:c:z:J:")) != -1) {
+		switch (opt) {
+			case 's':
+			case 'g':
+			case 'u':
+				mode = opt;
+				break;
+			case 'w':
+				writable = 1;
+				break;
+			case 'p':
+				val = strtoul(optarg, &end, 10);
+				if (*end != '\0' || val < 1 || val > 65535) {
+					fprintf(stderr, "Given port %s is not a valid one, should be between 1 and 65535 including.\n", optarg);
+					return EXIT_FAILURE;
+				}
+				port = val;
+				break;
+			case 'n':
+				val = strtoul(optarg, &end, 10);
+				if (*end != '\0' || val < 1 || val > XFER_MAX_CONNS) {
+					fprintf(stderr, "Connections should be between 1 and %d\n", XFER_MAX_CONNS);
+					return EXIT_FAILURE;
+				}
+				conns = val;
+				break;
+			case 'c':
+				val = strtoul(optarg, &end, 0);
+				if (*end != '\0' || val < 4096 || val > XFER_MAX_CHUNK) {
+					fprintf(stderr, "Chunk size should be between 4096 and %d\n", XFER_MAX_CHUNK);
+					return EXIT_FAILURE;
+				}
+				chunk = val;
+				break;
+			case 'z':
+				val = strtoul(optarg, &end, 10);
+				if (*end != '\0' || val > 9) {
+					fprintf(stderr, "Level should be between 0 and 9\n");
+					return EXIT_FAILURE;
+				}
+				level = val;
+				break;
+			case 'J':
+				journal = optarg;
+				break;
+			default:
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (mode == 0 || port == 0 || optind != argc - 1 || port + conns - 1 > 65535) {
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	/* a connection closing while we write to it is handled where it fails */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (mode == 's') {
+		return serve(argv[optind], port, conns, writable);
+	}
+	return transfer(argv[optind], journal, port, conns, chunk, level, mode == 'u');
+}
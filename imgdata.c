@@ -0,0 +1,560 @@
+/*
+ * Initially developed at Ghent University as part of a masters thesis promoted
+ * by prof. dr. ir. Bjorn De Sutter of the Computer Systems Lab in cooperation with ir. Daan Raman from NVISO.
+ * Description: Decoding/encoding of imgdata.img contents and a mmap backed reader, see imgdata.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "imgdata.h"
+
+/*
+ * Fills count RGB pixels at dst with the color of run, one by one
+ */
+void expand_run_scalar(unsigned char *dst, pixelrun *run, unsigned int count) {
+	while (count--) {
+		dst[0] = run->red;
+		dst[1] = run->green;
+		dst[2] = run->blue;
+		dst += 3;
+	}
+}
+
+/*
+ * Fills count RGB pixels at dst with the color of run
+ * Long runs are written as whole vectors of a repeating pattern of the color,
+ * which has a period of 3 vectors (48 bytes for SSE2, 96 for AVX2)
+ */
+void expand_run(unsigned char *dst, pixelrun *run, unsigned int count) {
+#if defined(__AVX2__) || defined(__SSE2__)
+	/* 8 bytes of the pattern starting at r, b and g: rgbrgbrg, brgbrgbr, gbrgbrgb */
+	unsigned long long p = run->red | run->green << 8 | run->blue << 16;
+	unsigned long long a = p | p << 24 | p << 48;
+	unsigned long long b = p >> 16 | p << 8 | p << 32 | p << 56;
+	unsigned long long c = p >> 8 | p << 16 | p << 40;
+#if defined(__AVX2__)
+	__m256i v0, v1, v2;
+
+	if (count >= 32) {
+		v0 = _mm256_set_epi64x(a, c, b, a);
+		v1 = _mm256_set_epi64x(b, a, c, b);
+		v2 = _mm256_set_epi64x(c, b, a, c);
+		for (; count >= 32; count -= 32, dst += 96) {
+			_mm256_storeu_si256((__m256i *) dst, v0);
+			_mm256_storeu_si256((__m256i *) (dst + 32), v1);
+			_mm256_storeu_si256((__m256i *) (dst + 64), v2);
+		}
+	}
+#else
+	__m128i v0, v1, v2;
+
+	if (count >= 16) {
+		v0 = _mm_set_epi64x(b, a);
+		v1 = _mm_set_epi64x(a, c);
+		v2 = _mm_set_epi64x(c, b);
+		for (; count >= 16; count -= 16, dst += 48) {
+			_mm_storeu_si128((__m128i *) dst, v0);
+			_mm_storeu_si128((__m128i *) (dst + 16), v1);
+			_mm_storeu_si128((__m128i *) (dst + 32), v2);
+		}
+	}
+#endif
+#endif
+	expand_run_scalar(dst, run, count);
+}
+
+/*
+ * Decodes nruns pixelruns into rows of width pixels, handing every full row to handler
+ * Runs crossing the end of a row are split over both rows
+ * Returns EXIT_FAILURE if handler did
+ */
+int decode_rows(pixelrun *buf, unsigned int nruns, unsigned int width, unsigned char *row,
+		void (*expand)(unsigned char *, pixelrun *, unsigned int), row_handler handler, void *data) {
+	unsigned int i, left, take, x = 0;
+
+	if (width == 0) {
+		return EXIT_SUCCESS;
+	}
+
+	for (i = 0; i < nruns; ++i) {
+		for (left = buf[i].count; left > 0; left -= take) {
+			take = width - x < left ? width - x : left;
+			expand(row + x * 3, &buf[i], take);
+			x += take;
+			if (x == width) {
+				if (handler(data, row) == EXIT_FAILURE) {
+					return EXIT_FAILURE;
+				}
+				x = 0;
+			}
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Reads the complete header of an imgdata.img
+ * The table is allocated with alloc(ctx, ...) once it is read, the caller releases it with ctx
+ * Returns EXIT_FAILURE if not a valid file or other problems
+ */
+int read_file_header(FILE *img, imgdatahdr *bimg, imgdata_file **imgs, imgdata_alloc alloc, void *ctx) {
+	unsigned char hdr[imgdatahdr_size], table[IMGDATA_MAX_FILES * imgdata_file_size];
+	int read = 0;
+	/* Read header without imgdata_file struct */
+	read = fread(hdr, imgdatahdr_size, 1, img);
+	if (read <= 0) {
+		return EXIT_FAILURE;
+	}
+	imgdatahdr_decode(bimg, hdr);
+	/* validate magic */
+	if (strncmp(bimg->magic, IMGDATA_MAGIC, IMGDATA_MAGIC_SIZE)) {
+		return EXIT_FAILURE;
+	}
+
+	if (bimg->num_files > IMGDATA_MAX_FILES) {
+		return EXIT_FAILURE;
+	}
+
+	/* read img_info headers, only allocated once they are all there */
+	read = fread(table, imgdata_file_size, bimg->num_files, img);
+	if (read != bimg->num_files) {
+		return EXIT_FAILURE;
+	}
+	*imgs = alloc(ctx, bimg->num_files * sizeof(imgdata_file) + 1);
+	if (*imgs == NULL) {
+		return EXIT_FAILURE;
+	}
+	imgdata_file_decode_array(*imgs, table, bimg->num_files);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Returns size rounded up to a whole number of blocks, 0 stays 0
+ */
+unsigned int block_size(unsigned int size) {
+	/* first -1 in case size == X*BLOCK_SIZE, after that +1 to get complete block */
+	return size == 0 ? 0 : (((size - 1) / IMGDATA_FILE_BLOCK_SIZE) + 1) * IMGDATA_FILE_BLOCK_SIZE;
+}
+
+/*
+ * Checks that nruns pixelruns make exactly width x height pixels, within IMGDATA_MAX_DIMENSION
+ * Decoders rely on this to never write past a row or hand out more rows than there are
+ * Returns EXIT_FAILURE if not
+ */
+int check_runs(pixelrun *buf, unsigned int nruns, unsigned int width, unsigned int height) {
+	unsigned long long pixels = 0;
+	unsigned int i = 0;
+
+	if (width > IMGDATA_MAX_DIMENSION || height > IMGDATA_MAX_DIMENSION) {
+		return EXIT_FAILURE;
+	}
+#if defined(__AVX2__)
+	/* keep only the count byte of every run and add them up 8 at a time */
+	unsigned long long part[4];
+	__m256i mask = _mm256_set1_epi32(0xff), sum = _mm256_setzero_si256();
+
+	for (; i + 8 <= nruns; i += 8) {
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_and_si256(_mm256_loadu_si256((__m256i *) (buf + i)), mask),
+			_mm256_setzero_si256()));
+	}
+	_mm256_storeu_si256((__m256i *) part, sum);
+	pixels = part[0] + part[1] + part[2] + part[3];
+#elif defined(__SSE2__)
+	/* keep only the count byte of every run and add them up 4 at a time */
+	unsigned long long part[2];
+	__m128i mask = _mm_set1_epi32(0xff), sum = _mm_setzero_si128();
+
+	for (; i + 4 <= nruns; i += 4) {
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_and_si128(_mm_loadu_si128((__m128i *) (buf + i)), mask), _mm_setzero_si128()));
+	}
+	_mm_storeu_si128((__m128i *) part, sum);
+	pixels = part[0] + part[1];
+#endif
+	for (; i < nruns; ++i) {
+		pixels += buf[i].count;
+	}
+
+	return pixels == (unsigned long long) width * height ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Returns the number of pixels, at most max (> 0), of px equal to the first one
+ * Every byte is compared to the byte one pixel further, a run ends at the pixel
+ * holding the first mismatching byte, so whole vectors can be compared at once
+ */
+unsigned int run_length(unsigned char *px, unsigned int max) {
+	size_t x = 0, limit = (size_t) max * 3 - 3;
+#if defined(__AVX2__)
+	unsigned int eq;
+
+	for (; x + 32 <= limit; x += 32) {
+		eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *) (px + x)),
+			_mm256_loadu_si256((__m256i *) (px + x + 3))));
+		if (eq != 0xffffffff) {
+			return (x + __builtin_ctz(~eq)) / 3 + 1;
+		}
+	}
+#elif defined(__SSE2__)
+	unsigned int eq;
+
+	for (; x + 16 <= limit; x += 16) {
+		eq = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) (px + x)),
+			_mm_loadu_si128((__m128i *) (px + x + 3))));
+		if (eq != 0xffff) {
+			return (x + __builtin_ctz(~eq)) / 3 + 1;
+		}
+	}
+#endif
+	while (x < limit && px[x] == px[x + 3]) {
+		++x;
+	}
+
+	return x / 3 + 1;
+}
+
+/*
+ * Encodes npixels RGB pixels to pixelruns, runs longer than 255 are split
+ * Only counts when out is NULL
+ * Returns the number of pixelruns
+ */
+unsigned int encode_runs(unsigned char *px, unsigned int npixels, pixelrun *out) {
+	unsigned int p = 0, len, take, l = 0;
+
+	while (p < npixels) {
+		len = run_length(px + (size_t) p * 3, npixels - p);
+		for (; len > 0; len -= take, p += take, ++l) {
+			take = len < 255 ? len : 255;
+			if (out != NULL) {
+				out[l].count = take;
+				out[l].red = px[(size_t) p * 3];
+				out[l].green = px[(size_t) p * 3 + 1];
+				out[l].blue = px[(size_t) p * 3 + 2];
+			}
+		}
+	}
+
+	return l;
+}
+
+/*
+ * Lossy step before encode_runs: every pixel differing at most maxerr per channel
+ * from the first pixel of the run it follows is given the color of that run
+ * Longer runs make a smaller content, no pixel ends up more than maxerr off
+ */
+void merge_colors(unsigned char *px, unsigned int npixels, unsigned int maxerr) {
+	unsigned char *run = px, *end = px + (size_t) npixels * 3;
+
+	if (maxerr == 0) {
+		return;
+	}
+	for (px += 3; px < end; px += 3) {
+		if (abs(px[0] - run[0]) <= (int) maxerr && abs(px[1] - run[1]) <= (int) maxerr && abs(px[2] - run[2]) <= (int) maxerr) {
+			px[0] = run[0];
+			px[1] = run[1];
+			px[2] = run[2];
+		} else {
+			run = px;
+		}
+	}
+}
+
+/*
+ * Checks the header of the imgdata.img at img->map and decodes its table
+ * Returns EXIT_FAILURE if not a valid file or out of memory
+ */
+static int load_table(imgdata *img) {
+	/* validate magic and that the table is inside the file and before the contents */
+	if (img->len < imgdatahdr_size) {
+		return EXIT_FAILURE;
+	}
+	imgdatahdr_decode(&img->hdr, img->map);
+	if (strncmp(img->hdr.magic, IMGDATA_MAGIC, IMGDATA_MAGIC_SIZE) || img->hdr.num_files > IMGDATA_MAX_FILES
+			|| img->hdr.num_files > (img->len - imgdatahdr_size) / imgdata_file_size) {
+		img->hdr.num_files = 0;
+		return EXIT_FAILURE;
+	}
+
+	img->files = malloc(img->hdr.num_files * sizeof(imgdata_file) + 1);
+	img->rows = calloc(img->hdr.num_files ? img->hdr.num_files : 1, sizeof(imgdata_row *));
+	img->checked = calloc(img->hdr.num_files ? img->hdr.num_files : 1, 1);
+	if (img->files == NULL || img->rows == NULL || img->checked == NULL) {
+		return EXIT_FAILURE;
+	}
+	imgdata_file_decode_array(img->files, img->map + imgdatahdr_size, img->hdr.num_files);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Maps the imgdata.img at path read-only and checks its header
+ * path may also be a bootloader.img, its imgdata image is then read where it is in the mapping
+ * Contents themselves are only read when decoded
+ * Returns EXIT_FAILURE if not a valid file or other problems
+ */
+int imgdata_open(const char *path, imgdata *img) {
+	struct stat st;
+	size_t offset, size;
+
+	memset(img, 0, sizeof(imgdata));
+	if ((img->fd = open(path, O_RDONLY)) < 0) {
+		perror("Error opening file");
+		return EXIT_FAILURE;
+	}
+	if (fstat(img->fd, &st) || st.st_size < (off_t) imgdatahdr_size) {
+		imgdata_close(img);
+		return EXIT_FAILURE;
+	}
+	img->maplen = st.st_size;
+	img->mapping = mmap(NULL, img->maplen, PROT_READ, MAP_PRIVATE, img->fd, 0);
+	if (img->mapping == MAP_FAILED) {
+		perror("Error mapping file");
+		img->mapping = NULL;
+		imgdata_close(img);
+		return EXIT_FAILURE;
+	}
+	img->map = img->mapping;
+	img->len = img->maplen;
+
+	if (!memcmp(img->mapping, BOOTLDR_MAGIC, BOOTLDR_MAGIC_SIZE)) {
+		if (bootldr_find(img->mapping, img->maplen, BOOTLDR_IMGDATA_NAME, &offset, &size) == EXIT_FAILURE) {
+			fprintf(stderr, "No valid %s image in bootloader.img %s\n", BOOTLDR_IMGDATA_NAME, path);
+			imgdata_close(img);
+			return EXIT_FAILURE;
+		}
+		img->map = img->mapping + offset;
+		img->len = size;
+	}
+
+	if (load_table(img) == EXIT_FAILURE) {
+		imgdata_close(img);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Reads the len bytes of an imgdata.img at buf where they are, e.g. a slice of a larger mapping
+ * buf is not copied and has to stay valid until imgdata_close
+ * Returns EXIT_FAILURE if not a valid file or other problems
+ */
+int imgdata_open_mem(const unsigned char *buf, size_t len, imgdata *img) {
+	memset(img, 0, sizeof(imgdata));
+	img->fd = -1;
+	img->map = (unsigned char *) buf;
+	img->len = len;
+
+	if (load_table(img) == EXIT_FAILURE) {
+		imgdata_close(img);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Unmaps img and frees its table and row indexes, safe on a failed imgdata_open(_mem)
+ */
+void imgdata_close(imgdata *img) {
+	unsigned int i;
+
+	if (img->rows != NULL) {
+		for (i = 0; i < img->hdr.num_files; ++i) {
+			free(img->rows[i]);
+		}
+		free(img->rows);
+		img->rows = NULL;
+	}
+	free(img->checked);
+	img->checked = NULL;
+	free(img->files);
+	img->files = NULL;
+	if (img->mapping != NULL) {
+		munmap(img->mapping, img->maplen);
+		img->mapping = NULL;
+	}
+	img->map = NULL;
+	if (img->fd >= 0) {
+		close(img->fd);
+		img->fd = -1;
+	}
+}
+
+/*
+ * Returns the index of the content called name, -1 if there is none
+ */
+int imgdata_find(imgdata *img, const char *name) {
+	size_t len = strlen(name);
+	unsigned int i;
+
+	if (len > IMGDATA_FILE_NAME_SIZE) {
+		return -1;
+	}
+	/* name in the table is not guaranteed to be terminated */
+	for (i = 0; i < img->hdr.num_files; ++i) {
+		if (!strncmp(img->files[i].name, name, len) && (len == IMGDATA_FILE_NAME_SIZE || img->files[i].name[len] == '\0')) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Returns the pixelruns of content i inside the mapping and their number in nruns
+ * The first time, the runs are checked to make exactly the pixels of the content
+ * Returns NULL if there is no content i, it lies (partly) outside the file or its runs don't match
+ */
+pixelrun *imgdata_runs(imgdata *img, unsigned int i, unsigned int *nruns) {
+	imgdata_file *imgfile;
+	pixelrun *buf;
+
+	if (i >= img->hdr.num_files) {
+		return NULL;
+	}
+	imgfile = &img->files[i];
+	if (imgfile->offset > img->len || imgfile->size > img->len - imgfile->offset || imgfile->offset % sizeof(pixelrun)) {
+		return NULL;
+	}
+
+	*nruns = imgfile->size / sizeof(pixelrun);
+	buf = (pixelrun *) (img->map + imgfile->offset);
+	/* no lock: workers asking for the same content at once store the same result */
+	if (img->checked[i] == 0) {
+		img->checked[i] = check_runs(buf, *nruns, imgfile->imgwidth, imgfile->imgheight) == EXIT_SUCCESS ? 1 : 2;
+	}
+
+	return img->checked[i] == 1 ? buf : NULL;
+}
+
+/*
+ * Builds the row index of content i, so imgdata_decode_rows starts a range
+ * at once instead of counting pixels from the start of the content
+ * Costs one pass over the runs and 8 bytes per row
+ */
+int imgdata_index(imgdata *img, unsigned int i) {
+	pixelrun *buf;
+	imgdata_row *rows;
+	unsigned int nruns, r, run = 0;
+	unsigned long long pos = 0, start; /* pixel at which run starts, first pixel of row r */
+
+	if ((buf = imgdata_runs(img, i, &nruns)) == NULL) {
+		return EXIT_FAILURE;
+	}
+	if (img->rows[i] != NULL) {
+		return EXIT_SUCCESS;
+	}
+	rows = malloc((img->files[i].imgheight ? img->files[i].imgheight : 1) * sizeof(imgdata_row));
+	if (rows == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	for (r = 0; r < img->files[i].imgheight; ++r) {
+		start = (unsigned long long) r * img->files[i].imgwidth;
+		while (run < nruns && pos + buf[run].count <= start) {
+			pos += buf[run++].count;
+		}
+		rows[r].run = run;
+		rows[r].skip = start - pos;
+	}
+	img->rows[i] = rows;
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Decodes count rows of content i, starting at row first, into out
+ * (count * imgwidth * 3 bytes of RGB), leaving the other rows alone
+ * Uses the row index of the content when imgdata_index built one
+ * Returns EXIT_FAILURE if the rows are not all in the content
+ */
+int imgdata_decode_rows(imgdata *img, unsigned int i, unsigned int first, unsigned int count, unsigned char *out) {
+	pixelrun *buf;
+	unsigned int nruns, run = 0, take;
+	unsigned long long skip, left; /* pixels to pass before first, pixels to decode */
+
+	if ((buf = imgdata_runs(img, i, &nruns)) == NULL
+			|| first > img->files[i].imgheight || count > img->files[i].imgheight - first) {
+		return EXIT_FAILURE;
+	}
+	left = (unsigned long long) count * img->files[i].imgwidth;
+	if (left == 0) {
+		return EXIT_SUCCESS;
+	}
+
+	if (img->rows[i] != NULL) {
+		run = img->rows[i][first].run;
+		skip = img->rows[i][first].skip;
+	} else {
+		skip = (unsigned long long) first * img->files[i].imgwidth;
+		while (run < nruns && buf[run].count <= skip) {
+			skip -= buf[run++].count;
+		}
+	}
+
+	for (; run < nruns && left > 0; ++run, skip = 0) {
+		take = buf[run].count - skip < left ? buf[run].count - skip : left;
+		expand_run(out, &buf[run], take);
+		out += take * 3;
+		left -= take;
+	}
+
+	return left == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Decodes content i straight into fb, a framebuffer of fbwidth x fbheight RGB pixels,
+ * at its position on screen, leaving the rest of fb alone
+ * Pixels falling outside fb are clipped
+ * Returns EXIT_FAILURE if there is no content i
+ */
+int imgdata_blit(imgdata *img, unsigned int i, unsigned char *fb, unsigned int fbwidth, unsigned int fbheight) {
+	imgdata_file *imgfile;
+	pixelrun *buf;
+	unsigned int nruns, run, left, take, x = 0, y, width, sx, visible;
+
+	if ((buf = imgdata_runs(img, i, &nruns)) == NULL) {
+		return EXIT_FAILURE;
+	}
+	imgfile = &img->files[i];
+	width = imgfile->imgwidth;
+	y = imgfile->scrypos;
+	if (width == 0 || imgfile->scrxpos >= fbwidth) {
+		return EXIT_SUCCESS;
+	}
+	/* pixels of a row that land on screen */
+	visible = fbwidth - imgfile->scrxpos < width ? fbwidth - imgfile->scrxpos : width;
+
+	/* same walk as decode_rows, but every piece of a run goes to its place on screen */
+	for (run = 0; run < nruns && y < fbheight; ++run) {
+		for (left = buf[run].count; left > 0 && y < fbheight; left -= take) {
+			take = width - x < left ? width - x : left;
+			if (x < visible) {
+				sx = imgfile->scrxpos + x;
+				expand_run(fb + ((size_t) y * fbwidth + sx) * 3, &buf[run], take < visible - x ? take : visible - x);
+			}
+			x += take;
+			if (x == width) {
+				x = 0;
+				++y;
+			}
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
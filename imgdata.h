@@ -0,0 +1,125 @@
+/*
+ * Initially developed at Ghent University as part of a masters thesis promoted
+ * by prof. dr. ir. Bjorn De Sutter of the Computer Systems Lab in cooperation with ir. Daan Raman from NVISO.
+ * Description: Format of the Android imgdata.img and a random-access reader for it
+ * Instructions: Compile imgdata.c along with the program using it, e.g.
+ *               gcc -o iunp imgdata_tool.c imgdata.c -lpng -lpthread
+ * Usage: imgdata_open() maps an imgdata.img, or the imgdata image inside a bootloader.img,
+ *        imgdata_open_mem() reads one already in memory, imgdata_find() looks up a content by name,
+ *        imgdata_decode_rows() decodes only the requested rows of it.
+ *        Contents are not touched before they are decoded, imgdata_index() optionally
+ *        builds a row index of a content so later row ranges start without scanning.
+ *        imgdata_blit() decodes a content straight into a screen sized framebuffer.
+ */
+
+#ifndef IMGDATA_H
+#define IMGDATA_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "lecodec.h"
+#include "bootldr.h"
+
+#define IMGDATA_MAGIC "IMGDATA!"
+#define IMGDATA_MAGIC_SIZE 8 /* No room for terminating \0 */
+#define IMGDATA_VERSION 1 /* value of unknown = version? */
+#define IMGDATA_FILE_BLOCK_SIZE 512 /* content size has to be multiple of this, padded with zeros, in bytes */
+#define IMGDATA_FILE_NAME_SIZE 16 /* max length of a filename (assuming not including terminating \0) */
+#define IMGDATA_FILE_OFFSET_START 1024 /* start of the first imgdata file in bytes */
+#define IMGDATA_SCREEN_WIDTH 1080 /* panel of the LG Nexus 5, scrxpos/scrypos are relative to it */
+#define IMGDATA_SCREEN_HEIGHT 1920
+#define IMGDATA_PARTITION_SIZE 3145728 /* imgdata partition of the LG Nexus 5, 3MiB */
+#define IMGDATA_MAX_DIMENSION 32768 /* wider or higher contents are taken as broken, rows are allocated by width */
+#define BOOTLDR_IMGDATA_NAME "imgdata" /* image in a bootloader.img holding the imgdata.img */
+
+/* imgdata.img header, unsigned int are in little endian on disk, see lecodec.h */
+#define IMGDATAHDR_FIELDS(U32, BYTES) \
+	BYTES(magic, IMGDATA_MAGIC_SIZE) \
+	U32(unknown) \
+	U32(num_files) \
+	U32(padding_a) \
+	U32(padding_b)
+
+/* part of the header, list of metadata of contents */
+#define IMGDATA_FILE_FIELDS(U32, BYTES) \
+	BYTES(name, IMGDATA_FILE_NAME_SIZE) \
+	U32(imgwidth) /* max 1080 for LG Nexus 5 */ \
+	U32(imgheight) /* max 1920 for LG Nexus 5 */ \
+	U32(scrxpos) /* pos on screen, 0 is leftmost */ \
+	U32(scrypos) /* pos on screen, 0 is topmost */ \
+	U32(offset) /* multiple of IMGDATA_FILE_BLOCK_SIZE */ \
+	U32(size)
+
+typedef struct {
+	LECODEC_STRUCT(IMGDATAHDR_FIELDS)
+} imgdatahdr;
+
+typedef struct {
+	LECODEC_STRUCT(IMGDATA_FILE_FIELDS)
+} imgdata_file;
+
+LECODEC(imgdatahdr, IMGDATAHDR_FIELDS)
+LECODEC(imgdata_file, IMGDATA_FILE_FIELDS)
+
+/* basic unit of content */
+typedef struct {
+        unsigned char count;
+        unsigned char red;
+        unsigned char green;
+        unsigned char blue;
+} pixelrun;
+
+/* where a row starts in the pixelruns of a content */
+typedef struct {
+	unsigned int run; /* first run holding pixels of the row */
+	unsigned int skip; /* pixels of that run belonging to earlier rows */
+} imgdata_row;
+
+/* an opened imgdata.img, see imgdata_open */
+typedef struct {
+	int fd;
+	unsigned char *mapping; /* whole file, read-only, NULL for imgdata_open_mem */
+	size_t maplen;
+	unsigned char *map; /* the imgdata.img in mapping or memory */
+	size_t len;
+	imgdatahdr hdr;
+	imgdata_file *files; /* hdr.num_files entries */
+	imgdata_row **rows; /* row index per content, NULL until imgdata_index */
+	unsigned char *checked; /* per content: 0 not yet, 1 valid, 2 broken, see imgdata_runs */
+} imgdata;
+
+/* most contents the table can hold before IMGDATA_FILE_OFFSET_START */
+#define IMGDATA_MAX_FILES ((IMGDATA_FILE_OFFSET_START - imgdatahdr_size) / imgdata_file_size)
+
+/* hands out size bytes for ctx, e.g. from an arena that the caller releases at once, NULL when out of memory */
+typedef void *(*imgdata_alloc)(void *ctx, size_t size);
+
+/* called for every decoded row, returns EXIT_FAILURE to stop decoding */
+typedef int (*row_handler)(void *data, unsigned char *row);
+
+/* RGB pixel kernels, both fill count pixels at dst with the color of run */
+void expand_run_scalar(unsigned char *dst, pixelrun *run, unsigned int count);
+void expand_run(unsigned char *dst, pixelrun *run, unsigned int count);
+
+int decode_rows(pixelrun *buf, unsigned int nruns, unsigned int width, unsigned char *row,
+		void (*expand)(unsigned char *, pixelrun *, unsigned int), row_handler handler, void *data);
+unsigned int run_length(unsigned char *px, unsigned int max);
+unsigned int encode_runs(unsigned char *px, unsigned int npixels, pixelrun *out);
+void merge_colors(unsigned char *px, unsigned int npixels, unsigned int maxerr);
+
+unsigned int block_size(unsigned int size);
+int check_runs(pixelrun *buf, unsigned int nruns, unsigned int width, unsigned int height);
+int read_file_header(FILE *img, imgdatahdr *bimg, imgdata_file **imgs, imgdata_alloc alloc, void *ctx);
+
+/* random-access reader */
+int imgdata_open(const char *path, imgdata *img);
+int imgdata_open_mem(const unsigned char *buf, size_t len, imgdata *img);
+void imgdata_close(imgdata *img);
+int imgdata_find(imgdata *img, const char *name);
+pixelrun *imgdata_runs(imgdata *img, unsigned int i, unsigned int *nruns);
+int imgdata_index(imgdata *img, unsigned int i);
+int imgdata_decode_rows(imgdata *img, unsigned int i, unsigned int first, unsigned int count, unsigned char *out);
+int imgdata_blit(imgdata *img, unsigned int i, unsigned char *fb, unsigned int fbwidth, unsigned int fbheight);
+
+#endif
@@ -4,13 +4,31 @@
  * Author: Christophe Beauval
  * Version: 20140801
  * Description: Unpacks/repacks/packs the Android imgdata.img and converts to/from PNG
- * Instructions: Two options to compile: dynamic: gcc -o iunp imgdata_tool.c -lpng
- *                                       static: gcc -o iunp imgdata_tool.c -lpng -lz -lm -static
+ * Instructions: Two options to compile: dynamic: gcc -o iunp imgdata_tool.c imgdata.c -lpng -lpthread
+ *                                       static: gcc -o iunp imgdata_tool.c imgdata.c -lpng -lz -lm -lpthread -static
+ *               Add -O2 (and -mavx2 or -march=native where available) for the vectorized decoder
  * Usage: $0 -l <imgdata.img> : list info and contents
- *           -x <imgdata.img> : extract contents in working dir
+ *           -x <imgdata.img> [name ...] : extract (the named) contents in working dir
  *           -u <imgdata.img> <file1:X[:Y[:W[:H]]]> [...] : update "file1" in <imgdata.img> with given coordinates and size, use - to keep existing value
  *           -r <imgdata.img> <file1.png>[:X[:Y]] [...] : replace "file1" in <imgdata.img> with given file and optionally new coordinates
  *           -c <imgdata.img> <file1.png:X:Y> [...] : creates a new imgdata.img (overwriting any existing!) with contents rest of arguments
+ *           -b <imgdata.img> : benchmark decoding of the contents, nothing is written
+ *           -s <imgdata.img> <screen.png:name1[,name2...]> [...] : render the named contents at their position on a 1080x1920 screen
+ *           -p <imgdata.img> <file1.png:X:Y> [...] : like -c, but equal contents are stored once, prints the size and only writes when it fits
+ *           -n <imgdata.img> <file1.png:X:Y> [...] : dry run of -p, only prints the size and if it would fit
+ *           -m <imgdata.img> <manifest> : like -c with the "file1.png X Y" lines of <manifest>, only PNGs changed since
+ *                                         the last build are encoded again, the runs are kept in <imgdata.img>.runs
+ *           Options for -x: -j N : extract N contents at the same time (for -c, -r and -m: parse N PNGs), N from 1 to 1024
+ *                           -z L : zlib compression level 0-9 of the PNGs
+ *                           -f none|sub|up|avg|paeth|all : PNG row filter(s), default none
+ *                           -o png|ppm|raw|stream : write PNG, PPM with name and position in comments, <name>.rgb
+ *                                                   (name, w, h, x, y header and RGB24 rows) or all .rgb to stdout
+ *                           -C <dir> : take PNGs made of the same content before from cache <dir>, adding new ones
+ *                           -z, -f and -o apply to -s as well
+ *           Options for -c, -r, -p, -n, -m: -e N : merge colors at most N apart per channel into one run (lossy, default 0)
+ *                                           -S B : partition size in bytes -p and -n have to fit in, default 3MiB
+ *           Options for all: -M : print allocations and peak memory of the run to stderr
+ *           -l, -x, -b and -s take a bootloader.img as well, its imgdata image is read in place without unpacking it
  *           X, Y, W, H are 32bit positive integers and can be given as 0x<HEX> and 0<OCT> as well
  *           "file1" name should not be longer than IMGDATA_FILE_NAME_SIZE chars, excluding extension, and be in current dir
  */
@@ -19,17 +37,24 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+#include <linux/fs.h> /* FICLONE */
 
 #include <png.h>
 
-#define IMGDATA_MAGIC "IMGDATA!"
-#define IMGDATA_MAGIC_SIZE 8 /* No room for terminating \0 */
-#define IMGDATA_VERSION 1 /* value of unknown = version? */
-#define IMGDATA_FILE_BLOCK_SIZE 512 /* content size has to be multiple of this, padded with zeros, in bytes */
-#define IMGDATA_FILE_NAME_SIZE 16 /* max length of a filename (assuming not including terminating \0) */
-#define IMGDATA_FILE_OFFSET_START 1024 /* start of the first imgdata file in bytes */
+#include "imgdata.h"
+
+#define MOVE_BUFFER_SIZE 65536 /* bytes moved at once when contents shift for -r */
+#define ARENA_BLOCK_SIZE 4096 /* smallest arena block, see arena_alloc */
+#define ARENA_ALIGN 16 /* alignment of every arena allocation */
+#define PNG_SIG_SIZE 8 /* bytes checked by png_sig_cmp */
+#define MAX_JOBS 1024 /* threads at most for -j */
 
 /* modes this program runs */
 #define RUN_NONE 0
@@ -38,6 +63,28 @@
 #define RUN_UPDATE 3
 #define RUN_REPLACE 4
 #define RUN_CREATE 5
+#define RUN_BENCH 6
+#define RUN_SCREEN 7
+#define RUN_PACK 8
+#define RUN_DRYRUN 9
+#define RUN_BUILD 10
+
+#define BENCH_ROUNDS 20 /* times every content is decoded for -b */
+
+#define CACHE_KEY_SIZE 64 /* room for a cache file name, see cache_key */
+#define FNV_OFFSET 14695981039346656037ULL /* start of an FNV-1a hash, see fnv1a */
+
+#define MANIFEST_LINE_SIZE 256 /* longest line of a -m manifest */
+#define RUNCACHE_SUFFIX ".runs" /* appended to <imgdata.img> for the sidecar of -m */
+#define RUNCACHE_MAGIC "IUNPRUNS"
+#define RUNCACHE_MAGIC_SIZE 8
+#define RUNCACHE_VERSION 1
+
+/* output formats of -x */
+#define OUT_PNG 0
+#define OUT_PPM 1 /* binary PPM (P6), name and position in comments */
+#define OUT_RAW 2 /* raw_header followed by RGB24 rows */
+#define OUT_STREAM 3 /* OUT_RAW of every content, one after the other on stdout */
 
 /* marks for changing metadata */
 #define MARK_X 1
@@ -46,40 +93,99 @@
 #define MARK_H 8
 #define MARK_S 16
 
-/* imgdata.img header */
+/* PNG cache of -C, shared by all -j workers */
 typedef struct {
-	char magic[IMGDATA_MAGIC_SIZE];
-	unsigned int unknown;
-	unsigned int num_files;
-	unsigned int padding_a;
-	unsigned int padding_b;
-} imgdatahdr;
-
-/* part of the header, list of metadata of contents */
+	int dirfd;
+	unsigned int hits;
+	unsigned int misses;
+	unsigned long long saved; /* bytes of PNG not encoded thanks to hits */
+	pthread_mutex_t lock; /* guards the counters */
+} png_cache;
+
+/* block of an arena, allocations are carved from data one after the other */
+typedef struct arena_block {
+	struct arena_block *next;
+	size_t size; /* bytes of data */
+	size_t used;
+	unsigned char data[];
+} arena_block;
+
+/* bump allocator for the buffers of a run (or of one -j worker), all released at once by arena_free */
 typedef struct {
-	char name[IMGDATA_FILE_NAME_SIZE];
-	unsigned int imgwidth; /* max 1080 for LG Nexus 5 */
-	unsigned int imgheight; /* max 1920 for LG Nexus 5 */
-	unsigned int scrxpos; /* pos on screen, 0 is leftmost */
-	unsigned int scrypos; /* pos on screen, 0 is topmost */
-	unsigned int offset; /* multiple of IMGDATA_FILE_BLOCK_SIZE */
-	unsigned int size;
-} imgdata_file;
-
-/* basic unit of content */
+	arena_block *blocks;
+	arena_block *borrowed; /* first block when taken from a parent by arena_init_from, not freed */
+	size_t held; /* bytes of all blocks */
+	size_t merged; /* peak bytes of worker arenas freed into this one */
+	unsigned long allocs; /* allocations served, also those of merged arenas */
+	unsigned int nblocks;
+	int shared; /* lock is used, for the run arena allocated from by -j workers */
+	pthread_mutex_t lock;
+} arena;
+
+/* options given next to the mode */
 typedef struct {
-        unsigned char count;
-        unsigned char red;
-        unsigned char green;
-        unsigned char blue;
-} pixelrun;
+	unsigned int jobs; /* contents handled at the same time */
+	int level; /* zlib level of written PNGs, -1 for the libpng default */
+	int filters; /* PNG_FILTER_* of written PNGs */
+	int format; /* OUT_* of -x */
+	char *cachedir; /* -C, NULL without */
+	png_cache *cache; /* opened cachedir, NULL without */
+	unsigned int maxerr; /* -e, max color error per channel when encoding, 0 is lossless */
+	unsigned long long partition; /* -S, bytes -p and -n have to fit in */
+	arena *arena; /* buffers of the run, shared by the -j workers */
+	int memstats; /* -M, print the use of the arenas to stderr */
+} tool_opts;
+
+/* precedes the pixels of a content for OUT_RAW and OUT_STREAM, fields as in imgdata_file, little endian */
+#define RAW_HEADER_FIELDS(U32, BYTES) \
+	BYTES(name, IMGDATA_FILE_NAME_SIZE) /* not terminated if IMGDATA_FILE_NAME_SIZE long */ \
+	U32(imgwidth) \
+	U32(imgheight) \
+	U32(scrxpos) \
+	U32(scrypos)
 
-/* representation of an encoded image */
 typedef struct {
-	char name[IMGDATA_FILE_NAME_SIZE + 1]; /* +1 for \0 */
-	unsigned int size;
-	pixelrun *content;
-} imgdata_content;
+	LECODEC_STRUCT(RAW_HEADER_FIELDS)
+} raw_header;
+
+LECODEC(raw_header, RAW_HEADER_FIELDS)
+
+/* shared state of the -j extract pool */
+typedef struct {
+	imgdata *img;
+	unsigned int *which; /* contents to extract, indexes in img->files */
+	int *results; /* EXIT_* per content */
+	tool_opts *opts;
+	size_t scratch; /* first block of a worker arena, fits a row and the runs of any content */
+	arena *workers; /* arena per worker, their first blocks carved from the run before starting */
+	unsigned int count;
+	unsigned int next; /* next content to pick up, guarded by lock */
+	unsigned int started; /* workers that took their arena, guarded by lock */
+	pthread_mutex_t lock;
+} extract_pool;
+
+/* produces the rows of an image one by one for handler, see content_rows and screen_rows */
+typedef int (*row_source)(void *src, unsigned char *row, row_handler handler, void *data);
+
+/* source of content_rows */
+typedef struct {
+	pixelrun *buf;
+	unsigned int nruns;
+	unsigned int width;
+} content_src;
+
+/* source of screen_rows, a decoded framebuffer */
+typedef struct {
+	unsigned char *fb;
+	unsigned int width;
+	unsigned int height;
+} screen_src;
+
+/* output of write_raw_row */
+typedef struct {
+	FILE *out;
+	unsigned int width; /* pixels per row */
+} raw_file;
 
 /* internal representation of cmd args */
 typedef struct {
@@ -90,19 +196,290 @@ typedef struct {
 	unsigned int h; /* max 1920 for LG Nexus 5 */
 	unsigned int size; /* size */
 	unsigned int bsize; /* size of content which is >= size as it's divisible by IMGDATA_FILE_BLOCK_SIZE */
+	unsigned int lsize; /* size of content without -e */
 	unsigned char mark;
 	pixelrun *content;
 } arg;
 
+/* shared state of the -j parse pool, see parse_png_files */
+typedef struct {
+	arg *ufile;
+	arena *run; /* contents are allocated from it */
+	unsigned int maxerr;
+	unsigned int count;
+	unsigned int next; /* next file to pick up, guarded by lock */
+	unsigned int failed; /* files skipped, guarded by lock */
+	pthread_mutex_t lock;
+} parse_pool;
+
+/* sidecar of -m: this header, then per PNG a runcache_entry followed by its bsize bytes of runs */
+#define RUNCACHE_HDR_FIELDS(U32, BYTES) \
+	BYTES(magic, RUNCACHE_MAGIC_SIZE) \
+	U32(version) \
+	U32(count)
+
+/* a PNG is unchanged if its mtime and size are, or else if its FNV-1a hash is */
+#define RUNCACHE_ENTRY_FIELDS(U32, BYTES) \
+	BYTES(name, IMGDATA_FILE_NAME_SIZE + 8) /* as in arg, \0 terminated */ \
+	U32(mtime) /* low 32 bits of the seconds */ \
+	U32(mtime_nsec) \
+	U32(fsize) \
+	U32(hash_lo) \
+	U32(hash_hi) \
+	U32(maxerr) /* -e the runs were encoded with */ \
+	U32(width) \
+	U32(height) \
+	U32(size) \
+	U32(lsize) \
+	U32(bsize)
+
+typedef struct {
+	LECODEC_STRUCT(RUNCACHE_HDR_FIELDS)
+} runcache_hdr;
+
+typedef struct {
+	LECODEC_STRUCT(RUNCACHE_ENTRY_FIELDS)
+} runcache_entry;
+
+LECODEC(runcache_hdr, RUNCACHE_HDR_FIELDS)
+LECODEC(runcache_entry, RUNCACHE_ENTRY_FIELDS)
+
+/* loaded sidecar of -m */
+typedef struct {
+	runcache_entry *entries;
+	unsigned char **runs; /* bsize bytes of each entry, where they are in the loaded file */
+	unsigned int count;
+} runcache;
+
+/*
+ * Starts an empty arena, shared when -j workers allocate from it at the same time
+ */
+void arena_init(arena *a, int shared) {
+	memset(a, 0, sizeof(arena));
+	a->shared = shared;
+	if (shared) {
+		pthread_mutex_init(&a->lock, NULL);
+	}
+}
+
+/*
+ * Returns room for size bytes in a block of a, NULL if none has it
+ * Called with a->lock held when shared
+ */
+static unsigned char *arena_room(arena *a, size_t size) {
+	arena_block *b;
+	size_t pad;
+
+	for (b = a->blocks; b != NULL; b = b->next) {
+		pad = -(size_t) (b->data + b->used) & (ARENA_ALIGN - 1);
+		if (b->size - b->used >= size + pad) {
+			b->used += pad + size;
+			return b->data + b->used - size;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Adds a block of at least size bytes to a
+ * Called with a->lock held when shared
+ */
+static int arena_grow(arena *a, size_t size) {
+	arena_block *b;
+
+	size += ARENA_ALIGN;
+	if (size < ARENA_BLOCK_SIZE) {
+		size = ARENA_BLOCK_SIZE;
+	}
+	if ((b = malloc(sizeof(arena_block) + size)) == NULL) {
+		return EXIT_FAILURE;
+	}
+	b->size = size;
+	b->used = 0;
+	b->next = a->blocks;
+	a->blocks = b;
+	a->held += size;
+	a->nblocks++;
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Makes sure the next size bytes of allocations fit in one block, so a run or worker
+ * sized up front from the header or the PNG dimensions takes a single malloc
+ */
+void arena_reserve(arena *a, size_t size) {
+	arena_block *b;
+	size_t left = 0;
+
+	if (a->shared) pthread_mutex_lock(&a->lock);
+	for (b = a->blocks; b != NULL; b = b->next) {
+		if (b->size - b->used > left) {
+			left = b->size - b->used;
+		}
+	}
+	if (left < size + ARENA_ALIGN) {
+		arena_grow(a, size);
+	}
+	if (a->shared) pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * Returns size bytes from a, aligned to ARENA_ALIGN and valid until arena_free
+ * A request no block has room for gets a block of its own size (at least ARENA_BLOCK_SIZE)
+ * Returns NULL when out of memory
+ */
+void *arena_alloc(arena *a, size_t size) {
+	unsigned char *p;
+
+	if (a->shared) pthread_mutex_lock(&a->lock);
+	if ((p = arena_room(a, size)) == NULL && arena_grow(a, size) == EXIT_SUCCESS) {
+		p = arena_room(a, size);
+	}
+	if (p != NULL) {
+		a->allocs++;
+	}
+	if (a->shared) pthread_mutex_unlock(&a->lock);
+
+	return p;
+}
+
+/*
+ * arena_alloc with the bytes set to zero
+ */
+void *arena_zalloc(arena *a, size_t size) {
+	void *p = arena_alloc(a, size);
+
+	if (p != NULL) {
+		memset(p, 0, size);
+	}
+	return p;
+}
+
+/*
+ * Starts a (not shared) arena with a first block of size bytes carved from parent,
+ * so the arenas of a -j pool are set up from the calling thread in one reservation of the run
+ * The block stays part of parent, arena_free only releases the blocks a added itself
+ * Returns EXIT_FAILURE when out of memory
+ */
+int arena_init_from(arena *a, arena *parent, size_t size) {
+	arena_block *b;
+
+	arena_init(a, 0);
+	size += ARENA_ALIGN;
+	if ((b = arena_alloc(parent, sizeof(arena_block) + size)) == NULL) {
+		return EXIT_FAILURE;
+	}
+	b->size = size;
+	b->used = 0;
+	b->next = NULL;
+	a->blocks = a->borrowed = b;
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * imgdata_alloc handing out memory of the arena ctx, for the table of read_file_header
+ */
+void *arena_imgdata_alloc(void *ctx, size_t size) {
+	return arena_alloc(ctx, size);
+}
+
+/*
+ * Makes all blocks of a (not shared) empty again, keeping them for the next item of a worker
+ */
+void arena_reset(arena *a) {
+	arena_block *b;
+
+	for (b = a->blocks; b != NULL; b = b->next) {
+		b->used = 0;
+	}
+}
+
+/*
+ * Releases all memory of a, adding its counters to into when not NULL
+ */
+void arena_free(arena *a, arena *into) {
+	arena_block *b;
+
+	while ((b = a->blocks) != NULL) {
+		a->blocks = b->next;
+		if (b != a->borrowed) {
+			free(b);
+		}
+	}
+	a->borrowed = NULL;
+	if (into != NULL) {
+		if (into->shared) pthread_mutex_lock(&into->lock);
+		into->allocs += a->allocs;
+		into->merged += a->held + a->merged;
+		if (into->shared) pthread_mutex_unlock(&into->lock);
+	}
+	if (a->shared) {
+		pthread_mutex_destroy(&a->lock);
+	}
+	a->held = 0;
+}
+
 /*
- * Converts content to PNG
+ * Prints the use of the run arena a for -M, before it is freed
+ * Worker arenas are counted at their peak, as if they were all alive at once
  */
-int convert_to_png(pixelrun *buf, imgdata_file imgfile, FILE *out) {
+void arena_report(arena *a) {
+	fprintf(stderr, "arena: %lu allocations, %u blocks, peak %zu bytes (%zu of workers)\n",
+		a->allocs, a->nblocks, a->held + a->merged, a->merged);
+}
+
+/*
+ * row_handler writing to PNG
+ */
+int write_png_row(void *data, unsigned char *row) {
+	png_write_row((png_structp) data, row);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * row_source decoding the pixelruns of a content into row
+ */
+int content_rows(void *src, unsigned char *row, row_handler handler, void *data) {
+	content_src *content = src;
+
+	return decode_rows(content->buf, content->nruns, content->width, row, expand_run, handler, data);
+}
+
+/*
+ * row_source handing out the rows of a framebuffer where they are, row is not used
+ */
+int screen_rows(void *src, unsigned char *row, row_handler handler, void *data) {
+	screen_src *screen = src;
+	unsigned int y;
+
+	/* rows are handed over straight from the framebuffer */
+	(void) row;
+	for (y = 0; y < screen->height; ++y) {
+		if (handler(data, screen->fb + (size_t) y * screen->width * 3) == EXIT_FAILURE) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Converts the rows of imgfile given by rows to PNG
+ * The row buffer comes from scratch
+ */
+int convert_to_png(row_source rows, void *src, imgdata_file imgfile, FILE *out, tool_opts *opts, arena *scratch) {
 	/* PNG structs */
 	png_structp png_ptr;
 	png_infop info_ptr;
-	png_byte row[imgfile.imgwidth * 3]; /* 3 bytes per pixel */
-	int i, j = 0, k;
+	png_bytep row;
+
+	/* 3 bytes per pixel, width comes from the file so not on the stack */
+	if ((row = arena_alloc(scratch, (size_t) imgfile.imgwidth * 3 + 1)) == NULL) {
+		return EXIT_FAILURE;
+	}
 
 	/* PNG inits */
 	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
@@ -116,8 +493,17 @@ int convert_to_png(pixelrun *buf, imgdata_file imgfile, FILE *out) {
 		return EXIT_FAILURE;
 	}
 
+	/* libpng jumps back here when it fails, e.g. on a full disk */
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		return EXIT_FAILURE;
+	}
+
 	png_init_io(png_ptr, out);
-	png_set_filter(png_ptr, 0, PNG_FILTER_VALUE_NONE);
+	png_set_filter(png_ptr, 0, opts->filters);
+	if (opts->level >= 0) {
+		png_set_compression_level(png_ptr, opts->level);
+	}
 	/* Fill IHDR */
 	png_set_IHDR(png_ptr, info_ptr,
 		imgfile.imgwidth,
@@ -130,20 +516,8 @@ int convert_to_png(pixelrun *buf, imgdata_file imgfile, FILE *out) {
 
 	png_write_info(png_ptr, info_ptr);
 
-	/* Start making rows, go over the (imgfile.size / 4) pixelruns */
-	for (i = 0; i < (imgfile.size >> 2); ++i) {
-		for (k = 0; k < buf[i].count; ++k) {
-			row[j] = buf[i].red;
-			row[j+1] = buf[i].green;
-			row[j+2] = buf[i].blue;
-			if (j + 3 == imgfile.imgwidth * 3) {
-				png_write_row(png_ptr, row);
-				j = 0;
-			} else {
-				j += 3;
-			}
-		}
-	}
+	/* Start making rows */
+	rows(src, row, write_png_row, png_ptr);
 
 	png_write_end(png_ptr, NULL);
 
@@ -158,48 +532,35 @@ void print_usage(char *errmsg) {
 		printf("Error: %s\n", errmsg);
 	}
 	printf("Usage: -l <imgdata.img> : list info and contents\n");
-	printf("       -x <imgdata.img> : extract contents in working dir\n");
+	printf("       -x <imgdata.img> [name ...] : extract (the named) contents in working dir\n");
 	printf("       -u <imgdata.img> <file1:X[:Y[:W[:H]]]> [...] : update \"file1\" in <imgdata.img> with given coordinates and size, use - to keep existing value\n");
 	printf("       -r <imgdata.img> <file1.png>[:X[:Y]] [...] : replace \"file1\" in <imgdata.img> with given file and optionally new coordinates\n");
 	printf("       -c <imgdata.img> <file1.png:X:Y> [...] : creates a new <imgdata.img> (overwriting any existing!) with contents rest of arguments\n");
+	printf("       -b <imgdata.img> : benchmark decoding of the contents, nothing is written\n");
+	printf("       -s <imgdata.img> <screen.png:name1[,name2...]> [...] : render the named contents at their position on a %dx%d screen\n", IMGDATA_SCREEN_WIDTH, IMGDATA_SCREEN_HEIGHT);
+	printf("       -p <imgdata.img> <file1.png:X:Y> [...] : like -c, but equal contents are stored once, prints the size and only writes when it fits\n");
+	printf("       -n <imgdata.img> <file1.png:X:Y> [...] : dry run of -p, only prints the size and if it would fit\n");
+	printf("       -m <imgdata.img> <manifest> : like -c with the \"file1.png X Y\" lines of <manifest>, only PNGs changed since\n");
+	printf("                                     the last build are encoded again, the runs are kept in <imgdata.img>%s\n", RUNCACHE_SUFFIX);
+	printf("       Options for -x: -j N : extract N contents at the same time (for -c, -r and -m: parse N PNGs), N from 1 to 1024\n");
+	printf("                       -z L : zlib compression level 0-9 of the PNGs\n");
+	printf("                       -f none|sub|up|avg|paeth|all : PNG row filter(s), default none\n");
+	printf("                       -o png|ppm|raw|stream : write PNG, PPM with name and position in comments, <name>.rgb\n");
+	printf("                                               (name, w, h, x, y header and RGB24 rows) or all .rgb to stdout\n");
+	printf("                       -C <dir> : take PNGs made of the same content before from cache <dir>, adding new ones\n");
+	printf("                       -z, -f and -o apply to -s as well\n");
+	printf("       Options for -c, -r, -p, -n, -m: -e N : merge colors at most N apart per channel into one run (lossy, default 0)\n");
+	printf("                                       -S B : partition size in bytes -p and -n have to fit in, default %d\n", IMGDATA_PARTITION_SIZE);
+	printf("       Options for all: -M : print allocations and peak memory of the run to stderr\n");
+	printf("       -l, -x, -b and -s take a bootloader.img as well, its %s image is read in place without unpacking it\n", BOOTLDR_IMGDATA_NAME);
 	printf("       X, Y, W, H are 32bit positive integers and can be given as 0x<HEX> and 0<OCT> as well\n");
 	printf("       \"file1\" name should not be longer than %d chars, excluding extension, and be in current dir\n", IMGDATA_FILE_NAME_SIZE);
 }
 
-/*
- * Reads the complete header of an imgdata.img
- * Returns EXIT_FAILURE if not a valid file or other problems
- */
-int read_file_header(FILE *img, imgdatahdr *bimg, imgdata_file **imgs) {
-	int read = 0;
-	/* Read header without imgdata_file struct */
-	read = fread(bimg, sizeof(imgdatahdr), 1, img);
-	if (read <= 0) {
-		return EXIT_FAILURE;
-	}
-	/* validate magic */
-	if (strncmp(bimg->magic, IMGDATA_MAGIC, IMGDATA_MAGIC_SIZE)) {
-		return EXIT_FAILURE;
-	}
-
-	/* read img_info headers */
-	*imgs = malloc(bimg->num_files * sizeof(imgdata_file));
-	if (*imgs == NULL) {
-		return EXIT_FAILURE;
-	}
-	read = fread(*imgs, sizeof(imgdata_file), bimg->num_files, img);
-	if (read <= 0) {
-		free(imgs);
-		return EXIT_FAILURE;
-	}
-
-	return EXIT_SUCCESS;
-}
-
 /*
  * Creates a new header based on parsed arguments
  */
-void create_file_header(imgdatahdr *bimg, imgdata_file **imgs, unsigned int count, arg ufile[]) {
+void create_file_header(imgdatahdr *bimg, imgdata_file **imgs, unsigned int count, arg ufile[], arena *run) {
 	int i, check;
 	char *dot;
 
@@ -211,9 +572,10 @@ void create_file_header(imgdatahdr *bimg, imgdata_file **imgs, unsigned int coun
 	bimg->padding_b = 0;
 
 	/* fill imgdata_file */
-	*imgs = calloc(count, sizeof(imgdata_file)); /* everything zero */
+	*imgs = arena_zalloc(run, count * sizeof(imgdata_file) + 1); /* everything zero */
 	if (*imgs == NULL) {
-		perror("Failed calloc of <*imgs> in create_file_header");
+		perror("Failed allocation of <*imgs> in create_file_header");
+		return;
 	}
 
 	for (i = 0; i < count; ++i) {
@@ -230,57 +592,47 @@ void create_file_header(imgdatahdr *bimg, imgdata_file **imgs, unsigned int coun
 }
 
 /*
- * Reads the encoded images of an imgdata.img
- * Returns EXIT_FAILURE if not a valid file or other problems
+ * Gets the name of a parsed file as stored in the header, without extension
  */
-int read_file_imgs(FILE *img, unsigned int count, imgdata_file *imgs, imgdata_content cont[]) {
-	int i;
-
-	for (i = 0; i < count; ++i) {
-		strncpy(cont[i].name, imgs[i].name, IMGDATA_FILE_NAME_SIZE);
-		cont[i].name[IMGDATA_FILE_NAME_SIZE] = '\0';
-
-		/* get size in full block
-		 * first -1 in case size == X*BLOCK_SIZE, after that +1 to get complete block */
-		cont[i].size = (((imgs[i].size - 1) / IMGDATA_FILE_BLOCK_SIZE) + 1) * IMGDATA_FILE_BLOCK_SIZE;
-		cont[i].content = malloc(cont[i].size);
-		if (cont[i].content == NULL) {
-			printf("Failed to allocate memory for %s: %s\n", cont[i].name, strerror(errno));
-			return EXIT_FAILURE;
-		}
+void arg_imgname(arg *ufile, char uname[IMGDATA_FILE_NAME_SIZE + 1]) {
+	char *dot;
+	int check;
 
-		/* Read content */
-		if (fseek(img, imgs[i].offset, SEEK_SET)) {
-			return EXIT_FAILURE;
-		}
-		if (fread(cont[i].content, cont[i].size, 1, img) <= 0) {
-			return EXIT_FAILURE;
-		}
+	dot = strrchr(ufile->name, '.');
+	check = IMGDATA_FILE_NAME_SIZE;
+	if (dot != NULL && dot - ufile->name < check) {
+		check = dot - ufile->name;
 	}
-
-	return EXIT_SUCCESS;
+	strncpy(uname, ufile->name, check);
+	uname[check] = '\0';
 }
 
 /*
  * Writes the complete header of an imgdata.img
  * Returns EXIT_FAILURE if not a valid file or other problems
  */
-int write_file_header(FILE *img, imgdatahdr *bimg, imgdata_file **imgs) {
+int write_file_header(FILE *img, imgdatahdr *bimg, imgdata_file **imgs, arena *run) {
+	unsigned char hdr[imgdatahdr_size], *table;
 	int write = 0;
 
 	/* back to start of file */
 	rewind(img);
 
 	/* write main header */
-	write = fwrite(bimg, sizeof(imgdatahdr), 1, img);
+	imgdatahdr_encode(hdr, bimg);
+	write = fwrite(hdr, imgdatahdr_size, 1, img);
 	if (write <= 0) {
 		return EXIT_FAILURE;
 	}
 
 	/* write img_info headers */
-	write = fwrite(*imgs, sizeof(imgdata_file), bimg->num_files, img);
-	if (write <= 0) {
-		free(imgs);
+	table = arena_alloc(run, bimg->num_files * imgdata_file_size + 1);
+	if (table == NULL) {
+		return EXIT_FAILURE;
+	}
+	imgdata_file_encode_array(table, *imgs, bimg->num_files);
+	write = fwrite(table, imgdata_file_size, bimg->num_files, img);
+	if (write != bimg->num_files) {
 		return EXIT_FAILURE;
 	}
 
@@ -288,148 +640,936 @@ int write_file_header(FILE *img, imgdatahdr *bimg, imgdata_file **imgs) {
 }
 
 /*
- * Writes the given converted images in place of the existing
- * Returns EXIT_FAILURE if not a valid file or other problems
+ * Moves len bytes in fd from offset from to offset to through a bounded buffer
+ * Copies from the end when moving forward, so overlapping ranges are fine
+ * Returns EXIT_FAILURE on short reads or writes
  */
-int write_file_imgs(FILE *img, imgdata_content cont[], unsigned int icount, arg ufile[], unsigned int ucount) {
-	int i, j, written;
-
-	/* to start of file content */
-	if (fseek(img, IMGDATA_FILE_OFFSET_START, SEEK_SET)) {
-		return EXIT_FAILURE;
-	}
-
-	for (i = 0; i < icount; ++i) {
-		written = 0;
-		for (j = 0; j < ucount; ++j) {
-			if (!strncmp(cont[i].name, ufile[j].name, strlen(cont[i].name))) {
-				if (fwrite(ufile[j].content, ufile[j].bsize, 1, img) <= 0) {
-					return EXIT_FAILURE;
-				}
-				written = 1;
-			}
-		}
-
-		/* if not written, content is not replaced, so put back original */
-		if (!written) {
-			if (fwrite(cont[i].content, cont[i].size, 1, img) <= 0) {
+int move_range(int fd, off_t from, off_t to, size_t len) {
+	char buf[MOVE_BUFFER_SIZE];
+	size_t chunk, done;
+
+	for (done = 0; done < len; done += chunk) {
+		chunk = len - done < MOVE_BUFFER_SIZE ? len - done : MOVE_BUFFER_SIZE;
+		if (to > from) {
+			/* take the chunk from the end */
+			if (pread(fd, buf, chunk, from + (len - done - chunk)) != chunk ||
+				pwrite(fd, buf, chunk, to + (len - done - chunk)) != chunk) {
 				return EXIT_FAILURE;
 			}
+		} else if (pread(fd, buf, chunk, from + done) != chunk || pwrite(fd, buf, chunk, to + done) != chunk) {
+			return EXIT_FAILURE;
 		}
 	}
 
-	/* truncate file to exact length */
-	if (ftruncate(fileno(img), ftell(img))) {
-		return EXIT_FAILURE;
-	}
-
 	return EXIT_SUCCESS;
 }
 
 /*
- * Writes the parsed files only, to be used when creating a new container
+ * Returns the index of the parsed file with new content for imgfile, or -1 if none
  */
-int write_file_args(FILE *img, arg ufile[], unsigned int count) {
+int find_replacement(imgdata_file *imgfile, arg ufile[], unsigned int ucount) {
+	char uname[IMGDATA_FILE_NAME_SIZE + 1];
 	int i;
 
-	/* flush and truncate file to exact start of content */
-	if (fflush(img)) {
-		return EXIT_FAILURE;
-	}
-	if (ftruncate(fileno(img), IMGDATA_FILE_OFFSET_START)) {
-		return EXIT_FAILURE;
+	for (i = 0; i < ucount; ++i) {
+		arg_imgname(&ufile[i], uname);
+		if ((ufile[i].mark & MARK_S) && !strncmp(uname, imgfile->name, IMGDATA_FILE_NAME_SIZE)) {
+			return i;
+		}
 	}
 
-	/* to start of file content */
-	if (fseek(img, IMGDATA_FILE_OFFSET_START, SEEK_SET)) {
-		return EXIT_FAILURE;
-	}
+	return -1;
+}
 
-	/* write new imgs */
-	for (i = 0; i < count; ++i) {
-		if (fwrite(ufile[i].content, ufile[i].bsize, 1, img) <= 0) {
-			return EXIT_FAILURE;
+/*
+ * Returns the index of an earlier image that stays and whose content image i shares
+ * in the header before -r (old, as -p writes equal contents once), or -1 if none
+ * A replaced image never shares, it gets its own blocks
+ */
+int shared_with(imgdata_file *old, unsigned int i, arg ufile[], unsigned int ucount) {
+	unsigned int k;
+
+	if (old[i].size == 0 || find_replacement(&old[i], ufile, ucount) >= 0) {
+		return -1;
+	}
+	for (k = 0; k < i; ++k) {
+		if (old[k].size > 0 && old[k].offset == old[i].offset && find_replacement(&old[k], ufile, ucount) < 0) {
+			return k;
 		}
 	}
 
-	return EXIT_SUCCESS;
+	return -1;
 }
 
 /*
- * Prints the info from the imgdata.img header
+ * Returns 1 if the contents of the header before -r (old) are stored in table order
+ * without overlapping, a content used by more images counted once, 0 if not
+ * Only then can update_header and replace_file_imgs shift them in place
  */
-void list_header_info(imgdatahdr *bimg, imgdata_file *imgs) {
-	int i;
-	/* Show complete magic, need to copy so we can terminate */
-	char magicstr[IMGDATA_MAGIC_SIZE + 1];
-	strncpy(magicstr, bimg->magic, IMGDATA_MAGIC_SIZE);
-	magicstr[IMGDATA_MAGIC_SIZE] = '\0';
-
-	printf("magic: %s\n", magicstr);
-	printf("unknown: %d\n", bimg->unknown);
-	printf("num_files: %d\n", bimg->num_files);
-	printf("padding_a: %d\n", bimg->padding_a);
-	printf("padding_b: %d\n", bimg->padding_b);
+int stored_in_order(imgdata_file *old, unsigned int icount) {
+	unsigned long long end = IMGDATA_FILE_OFFSET_START;
+	unsigned int i, k;
 
-	printf("                           \twidth\theight\tx-pos\ty-pos\toffset\tsize\n");
-	for (i = 0; i < bimg->num_files; ++i) {
-		printf("File %02d = %16s:\t%d\t%d\t%d\t%d\t%d\t%d\n", i, imgs[i].name, imgs[i].imgwidth, imgs[i].imgheight, imgs[i].scrxpos, imgs[i].scrypos, imgs[i].offset, imgs[i].size);
+	for (i = 0; i < icount; ++i) {
+		if (old[i].size == 0) {
+			continue;
+		}
+		for (k = 0; k < i; ++k) {
+			if (old[k].size > 0 && old[k].offset == old[i].offset) {
+				break;
+			}
+		}
+		if (k < i) {
+			continue;
+		}
+		if (old[i].offset < end) {
+			return 0;
+		}
+		end = (unsigned long long) old[i].offset + block_size(old[i].size);
 	}
+
+	return 1;
 }
 
 /*
- * Extracts the images and converts them to PNG
+ * Lays out the contents again after update_header, for an imgdata.img with shared
+ * contents or contents not in table order: every image that doesn't share (see
+ * shared_with) gets its own blocks in table order, the others the offset of the
+ * image they share with
  */
-void extract_contents(FILE *img, int num_files, imgdata_file *imgs) {
-	FILE *out;
-	pixelrun *buf;
-	int i;
+void layout_contents(imgdata_file *old, imgdata_file *imgs, unsigned int icount, arg ufile[], unsigned int ucount) {
+	unsigned int i;
+	unsigned long long next = IMGDATA_FILE_OFFSET_START;
+	int k;
 
-	for (i = 0; i < num_files; ++i) {
-		char outfile[strlen(imgs[i].name) + 5];
-		sprintf(outfile, "%s.png", imgs[i].name);
-		if (!(out = fopen(outfile, "w+"))) {
-			perror("Error opening file");
+	for (i = 0; i < icount; ++i) {
+		if ((k = shared_with(old, i, ufile, ucount)) >= 0) {
+			imgs[i].offset = imgs[k].offset;
 			continue;
 		}
-		printf("%s\n", outfile);
+		imgs[i].offset = next;
+		next += block_size(imgs[i].size);
+	}
+}
 
-		/* Read content to buffer */
-		fseek(img, imgs[i].offset, SEEK_SET);
-		buf = malloc(imgs[i].size);
-		/* Read in completely, sizes are limited with upperbound
-		   max partition size (3MiB on LG Nexus 5) minus header (1KiB)*/
-		fread(buf, imgs[i].size, 1, img);
+/*
+ * Returns 1 if two images of the header use the same content, as -p writes them
+ */
+int has_shared(imgdata_file *imgs, unsigned int icount) {
+	unsigned int i, k;
 
-		/* Convert to PNG */
-		if (convert_to_png(buf, imgs[i], out) == EXIT_FAILURE) {
-			printf("Error converting %s to PNG.\n", imgs[i].name);
+	for (i = 0; i < icount; ++i) {
+		for (k = 0; k < i; ++k) {
+			if (imgs[i].size > 0 && imgs[k].size > 0 && imgs[k].offset == imgs[i].offset) {
+				return 1;
+			}
 		}
-
-		if (buf != NULL) free(buf);
-		fclose(out);
 	}
+
+	return 0;
 }
 
 /*
- * Parses the given file(name)s for their coords (and size)
- * A MARK_* is put in the arg.mark for each changing value
+ * Writes the converted images at their offset in imgs and truncates fd after the last content
+ * Returns EXIT_FAILURE on write errors
  */
-void parse_args(unsigned int count, char *args[], arg ifile[]) {
-	int i, max;
-	char *str, *dot;
+int write_replaced(int fd, imgdata_file *imgs, unsigned int icount, arg ufile[], unsigned int ucount) {
+	unsigned int i;
+	off_t end = IMGDATA_FILE_OFFSET_START;
+	int r;
 
-	for (i = 0; i < count; ++i) {
-		ifile[i].mark = 0;
-		str = strtok(args[i], ":");
-		dot = strrchr(args[i], '.');
-		max = sizeof(ifile[i].name) - 1;
-		if ((dot != NULL && dot - args[i] > IMGDATA_FILE_NAME_SIZE) ||
-			(str != NULL && strlen(str) > max) ||
-			(dot == NULL && str != NULL && strlen(str) > IMGDATA_FILE_NAME_SIZE)
-		) {
-			printf("Filename %s too long, skipping\n", str);
-			continue;
+	for (i = 0; i < icount; ++i) {
+		if ((r = find_replacement(&imgs[i], ufile, ucount)) >= 0 &&
+			pwrite(fd, ufile[r].content, ufile[r].bsize, imgs[i].offset) != ufile[r].bsize) {
+			return EXIT_FAILURE;
+		}
+		if (imgs[i].offset + block_size(imgs[i].size) > end) {
+			end = imgs[i].offset + block_size(imgs[i].size);
+		}
+	}
+
+	/* truncate file to exact length */
+	if (ftruncate(fd, end)) {
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Writes the given converted images in place of the existing, based on the header
+ * before (old) and after (imgs) update_header
+ * Only images that changed their number of blocks move the ones behind them, so
+ * the rest of the file is not touched. Images moving to the front are moved first
+ * from the front, then images moving to the back from the back, so no image
+ * overwrites one that still has to be moved. Replaced images are written last.
+ * Contents have to be stored in table order, see stored_in_order
+ * Shared contents (see layout_contents) are moved once, with the first image using them
+ * Returns EXIT_FAILURE if not a valid file or other problems
+ */
+int replace_file_imgs(FILE *img, imgdata_file *old, imgdata_file *imgs, unsigned int icount, arg ufile[], unsigned int ucount) {
+	int fd = fileno(img);
+	unsigned int i;
+
+	/* nothing of the header may be pending in the stream */
+	if (fflush(img)) {
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < icount; ++i) {
+		if (imgs[i].offset < old[i].offset && find_replacement(&imgs[i], ufile, ucount) < 0 &&
+			shared_with(old, i, ufile, ucount) < 0 &&
+			move_range(fd, old[i].offset, imgs[i].offset, block_size(old[i].size)) == EXIT_FAILURE) {
+			return EXIT_FAILURE;
+		}
+	}
+	for (i = icount; i > 0; --i) {
+		if (imgs[i - 1].offset > old[i - 1].offset && find_replacement(&imgs[i - 1], ufile, ucount) < 0 &&
+			shared_with(old, i - 1, ufile, ucount) < 0 &&
+			move_range(fd, old[i - 1].offset, imgs[i - 1].offset, block_size(old[i - 1].size)) == EXIT_FAILURE) {
+			return EXIT_FAILURE;
+		}
+	}
+	return write_replaced(fd, imgs, icount, ufile, ucount);
+}
+
+/*
+ * Like replace_file_imgs, for contents that are not stored in table order (see
+ * stored_in_order) and laid out again by layout_contents: every content that stays
+ * is read into memory from run first, then all are written at their new offset
+ * Returns EXIT_FAILURE if a content can't be read, the file is then untouched
+ */
+int rewrite_file_imgs(FILE *img, imgdata_file *old, imgdata_file *imgs, unsigned int icount, arg ufile[], unsigned int ucount, arena *run) {
+	int fd = fileno(img);
+	unsigned char **kept;
+	unsigned int i;
+
+	if (fflush(img) || (kept = arena_alloc(run, icount * sizeof(unsigned char *) + 1)) == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < icount; ++i) {
+		kept[i] = NULL;
+		if (old[i].size == 0 || find_replacement(&old[i], ufile, ucount) >= 0 || shared_with(old, i, ufile, ucount) >= 0) {
+			continue;
+		}
+		/* the padding is written as zeros */
+		if ((kept[i] = arena_zalloc(run, block_size(old[i].size))) == NULL ||
+			pread(fd, kept[i], old[i].size, old[i].offset) != old[i].size) {
+			return EXIT_FAILURE;
+		}
+	}
+	for (i = 0; i < icount; ++i) {
+		if (kept[i] != NULL && pwrite(fd, kept[i], block_size(old[i].size), imgs[i].offset) != block_size(old[i].size)) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	return write_replaced(fd, imgs, icount, ufile, ucount);
+}
+
+/*
+ * Writes the parsed files only, to be used when creating a new container
+ */
+int write_file_args(FILE *img, arg ufile[], unsigned int count) {
+	int i;
+
+	/* flush and truncate file to exact start of content */
+	if (fflush(img)) {
+		return EXIT_FAILURE;
+	}
+	if (ftruncate(fileno(img), IMGDATA_FILE_OFFSET_START)) {
+		return EXIT_FAILURE;
+	}
+
+	/* to start of file content */
+	if (fseek(img, IMGDATA_FILE_OFFSET_START, SEEK_SET)) {
+		return EXIT_FAILURE;
+	}
+
+	/* write new imgs, skipped and shared ones have nothing to write */
+	for (i = 0; i < count; ++i) {
+		if (ufile[i].bsize > 0 && fwrite(ufile[i].content, ufile[i].bsize, 1, img) <= 0) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Lays out the contents for -p and -n: a content equal to an earlier one
+ * gets the offset of that one and is not written again (bsize becomes 0)
+ * shared[i] is the entry content i is shared with, -1 if none
+ * Returns the size of the resulting imgdata.img
+ */
+unsigned long long share_contents(imgdata_file *imgs, unsigned int count, arg ufile[], int shared[]) {
+	unsigned long long next = IMGDATA_FILE_OFFSET_START;
+	unsigned int i, j;
+
+	for (i = 0; i < count; ++i) {
+		shared[i] = -1;
+		for (j = 0; j < i && ufile[i].content != NULL; ++j) {
+			if (shared[j] < 0 && ufile[j].content != NULL && ufile[j].size == ufile[i].size
+					&& !memcmp(ufile[j].content, ufile[i].content, ufile[i].size)) {
+				shared[i] = j;
+				break;
+			}
+		}
+		if (shared[i] >= 0) {
+			imgs[i].offset = imgs[shared[i]].offset;
+			ufile[i].bsize = 0;
+		} else {
+			imgs[i].offset = next;
+			next += ufile[i].bsize;
+		}
+	}
+
+	return next;
+}
+
+/*
+ * Prints what -p and -n make of the contents and whether the result fits in opts->partition
+ * Returns EXIT_FAILURE if it doesn't fit
+ */
+int pack_report(imgdata_file *imgs, unsigned int count, arg ufile[], int shared[], unsigned long long total, tool_opts *opts) {
+	unsigned long long dedup = 0, merged = 0;
+	unsigned int i;
+
+	printf("%-16s\t%s\t%s\t%s\t%s\t%s\n", "name", "width", "height", "size", "blocks", "lossless");
+	for (i = 0; i < count; ++i) {
+		printf("%-16.*s\t%u\t%u\t%u\t%u\t%u", IMGDATA_FILE_NAME_SIZE, imgs[i].name, imgs[i].imgwidth, imgs[i].imgheight,
+			ufile[i].size, ufile[i].bsize, ufile[i].lsize);
+		if (shared[i] >= 0) {
+			printf("\tshared with %.*s", IMGDATA_FILE_NAME_SIZE, imgs[shared[i]].name);
+			dedup += block_size(ufile[i].size);
+		} else {
+			merged += block_size(ufile[i].lsize) - ufile[i].bsize;
+		}
+		printf("\n");
+	}
+
+	printf("saved: %llu bytes by sharing, %llu bytes by -e %u\n", dedup, merged, opts->maxerr);
+	if (count > IMGDATA_MAX_FILES) {
+		printf("does not fit: %u entries do not fit in the header\n", count);
+		return EXIT_FAILURE;
+	}
+	if (total > opts->partition) {
+		printf("does not fit: %llu of %llu bytes, %llu bytes over\n", total, opts->partition, total - opts->partition);
+		return EXIT_FAILURE;
+	}
+	printf("fits: %llu of %llu bytes, %llu bytes to spare\n", total, opts->partition, opts->partition - total);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Prints the info from the imgdata.img header
+ */
+void list_header_info(imgdatahdr *bimg, imgdata_file *imgs) {
+	int i;
+	/* Show complete magic, need to copy so we can terminate */
+	char magicstr[IMGDATA_MAGIC_SIZE + 1];
+	strncpy(magicstr, bimg->magic, IMGDATA_MAGIC_SIZE);
+	magicstr[IMGDATA_MAGIC_SIZE] = '\0';
+
+	printf("magic: %s\n", magicstr);
+	printf("unknown: %d\n", bimg->unknown);
+	printf("num_files: %d\n", bimg->num_files);
+	printf("padding_a: %d\n", bimg->padding_a);
+	printf("padding_b: %d\n", bimg->padding_b);
+
+	printf("                           \twidth\theight\tx-pos\ty-pos\toffset\tsize\n");
+	for (i = 0; i < bimg->num_files; ++i) {
+		printf("File %02d = %16s:\t%d\t%d\t%d\t%d\t%d\t%d\n", i, imgs[i].name, imgs[i].imgwidth, imgs[i].imgheight, imgs[i].scrxpos, imgs[i].scrypos, imgs[i].offset, imgs[i].size);
+	}
+}
+
+/*
+ * row_handler writing the RGB24 row of width (in data) pixels to a FILE
+ */
+int write_raw_row(void *data, unsigned char *row) {
+	raw_file *raw = data;
+
+	return fwrite(row, raw->width * 3, 1, raw->out) == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Writes the rows of imgfile given by rows as PPM or raw_header + RGB24 rows to out
+ * Nothing is compressed, so this is what to use when the next step decodes the PNG again
+ * The row buffer comes from scratch
+ */
+int convert_to_raw(row_source rows, void *src, imgdata_file imgfile, FILE *out, int format, arena *scratch) {
+	raw_header hdr;
+	raw_file raw = {out, imgfile.imgwidth};
+	unsigned char *row, buf[raw_header_size];
+
+	/* 3 bytes per pixel, never 0 long */
+	if ((row = arena_alloc(scratch, (size_t) imgfile.imgwidth * 3 + 1)) == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	if (format == OUT_PPM) {
+		if (fprintf(out, "P6\n# name %.*s\n# pos %u %u\n%u %u\n255\n", IMGDATA_FILE_NAME_SIZE, imgfile.name,
+				imgfile.scrxpos, imgfile.scrypos, imgfile.imgwidth, imgfile.imgheight) < 0) {
+			return EXIT_FAILURE;
+		}
+	} else {
+		memcpy(hdr.name, imgfile.name, IMGDATA_FILE_NAME_SIZE);
+		hdr.imgwidth = imgfile.imgwidth;
+		hdr.imgheight = imgfile.imgheight;
+		hdr.scrxpos = imgfile.scrxpos;
+		hdr.scrypos = imgfile.scrypos;
+		raw_header_encode(buf, &hdr);
+		if (fwrite(buf, raw_header_size, 1, out) != 1) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	return rows(src, row, write_raw_row, &raw);
+}
+
+/*
+ * Returns the FNV-1a hash of len bytes at p, continued from hash (FNV_OFFSET to start one)
+ */
+unsigned long long fnv1a(unsigned long long hash, const unsigned char *p, size_t len) {
+	const unsigned char *end = p + len;
+
+	for (; p < end; ++p) {
+		hash = (hash ^ *p) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+/*
+ * Puts the cache file name of the nruns pixelruns in buf, written as PNG of
+ * width x height with the options of opts, in key (CACHE_KEY_SIZE)
+ * The hash is FNV-1a, the runs are stored next to the PNG to rule out collisions
+ */
+void cache_key(pixelrun *buf, unsigned int nruns, imgdata_file *imgfile, tool_opts *opts, char *key) {
+	unsigned long long hash = fnv1a(FNV_OFFSET, (unsigned char *) buf, (size_t) nruns * sizeof(pixelrun));
+
+	snprintf(key, CACHE_KEY_SIZE, "%016llx-%ux%u-z%d-f%d", hash, imgfile->imgwidth, imgfile->imgheight, opts->level, opts->filters);
+}
+
+/*
+ * Copies file from in dir fromfd to to in dir tofd, replacing it
+ * A reflink is tried first, it shares the blocks until either file is written
+ */
+int copy_file(int fromfd, const char *from, int tofd, const char *to) {
+	char buf[MOVE_BUFFER_SIZE];
+	ssize_t len = 0;
+	int in, out, ret = EXIT_SUCCESS;
+
+	if ((in = openat(fromfd, from, O_RDONLY)) < 0) {
+		return EXIT_FAILURE;
+	}
+	if ((out = openat(tofd, to, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		close(in);
+		return EXIT_FAILURE;
+	}
+#ifdef FICLONE
+	if (!ioctl(out, FICLONE, in)) {
+		close(in);
+		close(out);
+		return EXIT_SUCCESS;
+	}
+#endif
+	while ((len = read(in, buf, sizeof(buf))) > 0) {
+		if (write(out, buf, len) != len) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+	if (len < 0) {
+		ret = EXIT_FAILURE;
+	}
+
+	close(in);
+	close(out);
+	return ret;
+}
+
+/*
+ * Puts a copy of the cached PNG of key at outfile, never a hardlink, as editing
+ * the extracted PNG in place would change the cache as well
+ * Only a hit if key.runs holds exactly the nruns pixelruns of buf
+ * Returns EXIT_FAILURE on a miss
+ */
+int cache_fetch(png_cache *cache, const char *key, pixelrun *buf, unsigned int nruns, const char *outfile, arena *scratch) {
+	char name[CACHE_KEY_SIZE + 6];
+	size_t size = (size_t) nruns * sizeof(pixelrun);
+	unsigned char *runs;
+	struct stat st;
+	int fd, same = 0;
+
+	snprintf(name, sizeof(name), "%s.runs", key);
+	if ((fd = openat(cache->dirfd, name, O_RDONLY)) < 0) {
+		return EXIT_FAILURE;
+	}
+	if (!fstat(fd, &st) && st.st_size == (off_t) size && (runs = arena_alloc(scratch, size)) != NULL) {
+		same = pread(fd, runs, size, 0) == (ssize_t) size && !memcmp(runs, buf, size);
+	}
+	close(fd);
+	if (!same) {
+		return EXIT_FAILURE;
+	}
+
+	snprintf(name, sizeof(name), "%s.png", key);
+	if (fstatat(cache->dirfd, name, &st, 0)) {
+		return EXIT_FAILURE;
+	}
+	unlink(outfile);
+	if (copy_file(cache->dirfd, name, AT_FDCWD, outfile) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	cache->hits++;
+	cache->saved += st.st_size;
+	pthread_mutex_unlock(&cache->lock);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Adds the freshly written outfile to the cache under key, along with the runs it was made of
+ * Both go in under a temporary name first, so other processes never see half an entry
+ * The PNG is copied, for the same reason cache_fetch copies it
+ */
+void cache_store(png_cache *cache, const char *key, pixelrun *buf, unsigned int nruns, const char *outfile) {
+	char name[CACHE_KEY_SIZE + 6], tmp[CACHE_KEY_SIZE + 32];
+	size_t size = (size_t) nruns * sizeof(pixelrun);
+	int fd;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->misses++;
+	pthread_mutex_unlock(&cache->lock);
+
+	snprintf(tmp, sizeof(tmp), "%s.png.%ld.%lx", key, (long) getpid(), (unsigned long) pthread_self());
+	snprintf(name, sizeof(name), "%s.png", key);
+	if (copy_file(AT_FDCWD, outfile, cache->dirfd, tmp) == EXIT_FAILURE || renameat(cache->dirfd, tmp, cache->dirfd, name)) {
+		unlinkat(cache->dirfd, tmp, 0);
+		return;
+	}
+
+	/* the runs make the entry valid, so they go last */
+	snprintf(tmp, sizeof(tmp), "%s.runs.%ld.%lx", key, (long) getpid(), (unsigned long) pthread_self());
+	snprintf(name, sizeof(name), "%s.runs", key);
+	if ((fd = openat(cache->dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		return;
+	}
+	if (write(fd, buf, size) != (ssize_t) size || close(fd) || renameat(cache->dirfd, tmp, cache->dirfd, name)) {
+		unlinkat(cache->dirfd, tmp, 0);
+	}
+}
+
+/*
+ * Returns the extension of files written in format
+ */
+const char *format_extension(int format) {
+	return format == OUT_PPM ? "ppm" : format == OUT_PNG ? "png" : "rgb";
+}
+
+/*
+ * Extracts content i of img and converts it to <name>.png (or .ppm, .rgb),
+ * or appends it to stdout for OUT_STREAM
+ * With -C a PNG made of the same runs before is taken from the cache instead
+ * The content is decoded straight from the mapping of img, buffers come from scratch
+ */
+int extract_content(imgdata *img, unsigned int i, tool_opts *opts, arena *scratch) {
+	FILE *out = stdout;
+	content_src content;
+	pixelrun *buf;
+	unsigned int nruns;
+	int ret;
+	char outfile[IMGDATA_FILE_NAME_SIZE + 5], key[CACHE_KEY_SIZE];
+
+	/* name is not guaranteed to be terminated */
+	snprintf(outfile, sizeof(outfile), "%.*s.%s", IMGDATA_FILE_NAME_SIZE, img->files[i].name, format_extension(opts->format));
+	if ((buf = imgdata_runs(img, i, &nruns)) == NULL) {
+		fprintf(stderr, "Error reading %s\n", outfile);
+		return EXIT_FAILURE;
+	}
+	if (opts->format == OUT_PNG && opts->cache != NULL) {
+		cache_key(buf, nruns, &img->files[i], opts, key);
+		if (cache_fetch(opts->cache, key, buf, nruns, outfile, scratch) == EXIT_SUCCESS) {
+			return EXIT_SUCCESS;
+		}
+		/* an earlier outfile may be a link into the cache, which must stay as is */
+		unlink(outfile);
+	}
+	if (opts->format != OUT_STREAM && !(out = fopen(outfile, "w+"))) {
+		perror("Error opening file");
+		return EXIT_FAILURE;
+	}
+
+	content.buf = buf;
+	content.nruns = nruns;
+	content.width = img->files[i].imgwidth;
+	if (opts->format == OUT_PNG) {
+		ret = convert_to_png(content_rows, &content, img->files[i], out, opts, scratch);
+	} else {
+		ret = convert_to_raw(content_rows, &content, img->files[i], out, opts->format, scratch);
+	}
+	if (ret == EXIT_FAILURE) {
+		fprintf(stderr, "Error converting %.*s to %s.\n", IMGDATA_FILE_NAME_SIZE, img->files[i].name, format_extension(opts->format));
+	}
+
+	if (out != stdout) fclose(out);
+	if (ret == EXIT_SUCCESS && opts->format == OUT_PNG && opts->cache != NULL) {
+		cache_store(opts->cache, key, buf, nruns, outfile);
+	}
+	return ret;
+}
+
+/*
+ * Worker of the -j pool, extracts contents until none are left
+ * The mapping is only read, so workers share nothing but the counters
+ * Each worker takes an arena of pool->workers, emptied after every content
+ */
+void *extract_worker(void *data) {
+	extract_pool *pool = data;
+	arena *scratch;
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->lock);
+	scratch = &pool->workers[pool->started++];
+	pthread_mutex_unlock(&pool->lock);
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (i >= pool->count) {
+			break;
+		}
+		pool->results[i] = extract_content(pool->img, pool->which[i], pool->opts, scratch);
+		arena_reset(scratch);
+	}
+
+	arena_free(scratch, pool->opts->arena);
+	return NULL;
+}
+
+/*
+ * Looks up the count names of contents to extract, all contents if count is 0
+ * Returns their indexes (from run) in which, or EXIT_FAILURE if a name is unknown
+ */
+int select_contents(imgdata *img, unsigned int count, char *names[], unsigned int **which, unsigned int *wcount, arena *run) {
+	unsigned int i;
+	int found;
+
+	*wcount = count ? count : img->hdr.num_files;
+	*which = arena_alloc(run, (*wcount ? *wcount : 1) * sizeof(unsigned int));
+	if (*which == NULL) {
+		printf("Failed to allocate memory: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < *wcount; ++i) {
+		if (count == 0) {
+			(*which)[i] = i;
+		} else if ((found = imgdata_find(img, names[i])) < 0) {
+			printf("No content called %s\n", names[i]);
+			return EXIT_FAILURE;
+		} else {
+			(*which)[i] = found;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Extracts the given contents and converts them to PNG, opts->jobs at the same time
+ * A stream on stdout has to be in order, so OUT_STREAM is written one by one without names
+ * Only the names of contents extracted without errors are printed
+ * Returns EXIT_FAILURE if any content failed
+ */
+int extract_contents(imgdata *img, unsigned int *which, unsigned int count, tool_opts *opts) {
+	extract_pool pool;
+	arena scratch;
+	pthread_t *threads;
+	unsigned int i, started, jobs = opts->jobs < count ? opts->jobs : count;
+	size_t need;
+	int ret = EXIT_SUCCESS;
+
+	/* a worker needs a row of the widest content, and with -C its runs */
+	pool.scratch = 0;
+	for (i = 0; i < count; ++i) {
+		need = (size_t) img->files[which[i]].imgwidth * 3 + ARENA_ALIGN;
+		if (opts->cache != NULL) {
+			need += (size_t) img->files[which[i]].size + ARENA_ALIGN;
+		}
+		if (need > pool.scratch) {
+			pool.scratch = need;
+		}
+	}
+
+	if (opts->format == OUT_STREAM) {
+		arena_init(&scratch, 0);
+		arena_reserve(&scratch, pool.scratch);
+		for (i = 0; i < count; ++i) {
+			if (extract_content(img, which[i], opts, &scratch) == EXIT_FAILURE) {
+				ret = EXIT_FAILURE;
+				break;
+			}
+			arena_reset(&scratch);
+		}
+		arena_free(&scratch, opts->arena);
+		fflush(stdout);
+		return ret;
+	}
+
+	pool.img = img;
+	pool.which = which;
+	pool.opts = opts;
+	pool.count = count;
+	pool.next = 0;
+	pool.started = 0;
+	pool.workers = NULL;
+	threads = arena_alloc(opts->arena, (jobs > 1 ? jobs : 1) * sizeof(pthread_t));
+	if (jobs > 1) {
+		/* worker arenas from one block of the run, a malloc in a worker would give it a malloc arena of its own */
+		arena_reserve(opts->arena, jobs * (sizeof(arena) + sizeof(arena_block) + pool.scratch + 3 * ARENA_ALIGN) + count * sizeof(int));
+		pool.workers = arena_alloc(opts->arena, jobs * sizeof(arena));
+		for (i = 0; pool.workers != NULL && i < jobs; ++i) {
+			if (arena_init_from(&pool.workers[i], opts->arena, pool.scratch) == EXIT_FAILURE) {
+				pool.workers = NULL;
+			}
+		}
+	}
+	if (jobs <= 1 || threads == NULL || pool.workers == NULL || !(pool.results = arena_alloc(opts->arena, count * sizeof(int)))) {
+		arena_init(&scratch, 0);
+		arena_reserve(&scratch, pool.scratch);
+		for (i = 0; i < count; ++i) {
+			if (extract_content(img, which[i], opts, &scratch) == EXIT_FAILURE) {
+				ret = EXIT_FAILURE;
+			} else {
+				printf("%.*s.%s\n", IMGDATA_FILE_NAME_SIZE, img->files[which[i]].name, format_extension(opts->format));
+			}
+			arena_reset(&scratch);
+		}
+		arena_free(&scratch, opts->arena);
+		return ret;
+	}
+
+	pthread_mutex_init(&pool.lock, NULL);
+	for (started = 0; started < jobs; ++started) {
+		if (pthread_create(&threads[started], NULL, extract_worker, &pool)) {
+			break;
+		}
+	}
+	/* if no thread could be started, do the work ourselves */
+	if (started == 0) {
+		extract_worker(&pool);
+	}
+	for (i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&pool.lock);
+
+	/* names in the given order, as without -j */
+	for (i = 0; i < count; ++i) {
+		if (pool.results[i] == EXIT_FAILURE) {
+			ret = EXIT_FAILURE;
+		} else {
+			printf("%.*s.%s\n", IMGDATA_FILE_NAME_SIZE, img->files[which[i]].name, format_extension(opts->format));
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * extract_contents with the cache of opts->cachedir, when given, and a summary of its use
+ * Returns EXIT_FAILURE if the cache can't be opened or any content failed
+ */
+int extract_cached(imgdata *img, unsigned int *which, unsigned int count, tool_opts *opts) {
+	png_cache cache;
+	int ret;
+
+	if (opts->cachedir == NULL || opts->format != OUT_PNG) {
+		return extract_contents(img, which, count, opts);
+	}
+	memset(&cache, 0, sizeof(png_cache));
+	mkdir(opts->cachedir, 0755);
+	if ((cache.dirfd = open(opts->cachedir, O_RDONLY | O_DIRECTORY)) < 0) {
+		perror("Error opening cache");
+		return EXIT_FAILURE;
+	}
+	pthread_mutex_init(&cache.lock, NULL);
+	opts->cache = &cache;
+
+	ret = extract_contents(img, which, count, opts);
+
+	printf("cache: %u hits, %u misses (%.1f%% hit rate), %llu bytes saved\n", cache.hits, cache.misses,
+		cache.hits + cache.misses ? 100.0 * cache.hits / (cache.hits + cache.misses) : 0.0, cache.saved);
+	opts->cache = NULL;
+	pthread_mutex_destroy(&cache.lock);
+	close(cache.dirfd);
+	return ret;
+}
+
+/*
+ * Renders the screens given as <file>:<name>[,<name>...] by blitting the named contents,
+ * in the given order, to their position in one framebuffer of the panel size
+ * The framebuffer is allocated once and cleared to black for every screen
+ * Screens are written as opts->format, OUT_STREAM appends them all to stdout
+ */
+int render_screens(imgdata *img, unsigned int count, char *args[], tool_opts *opts) {
+	screen_src screen = {NULL, IMGDATA_SCREEN_WIDTH, IMGDATA_SCREEN_HEIGHT};
+	imgdata_file scrfile;
+	FILE *out;
+	char *names, *name, *save;
+	unsigned int i;
+	int found, ret = EXIT_SUCCESS;
+
+	screen.fb = arena_alloc(opts->arena, (size_t) screen.width * screen.height * 3);
+	if (screen.fb == NULL) {
+		printf("Failed to allocate memory for the screen: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	memset(&scrfile, 0, sizeof(imgdata_file));
+	scrfile.imgwidth = screen.width;
+	scrfile.imgheight = screen.height;
+
+	for (i = 0; i < count; ++i) {
+		if ((names = strchr(args[i], ':')) == NULL) {
+			fprintf(stderr, "No contents given for screen %s\n", args[i]);
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		*names++ = '\0';
+
+		memset(screen.fb, 0, (size_t) screen.width * screen.height * 3);
+		for (name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+			if ((found = imgdata_find(img, name)) < 0 || imgdata_blit(img, found, screen.fb, screen.width, screen.height) == EXIT_FAILURE) {
+				fprintf(stderr, "Error drawing %s on %s\n", name, args[i]);
+				ret = EXIT_FAILURE;
+			}
+		}
+
+		/* the screen file name stands in for the content name in PPM and raw headers */
+		memset(scrfile.name, 0, IMGDATA_FILE_NAME_SIZE);
+		memcpy(scrfile.name, args[i], strnlen(args[i], IMGDATA_FILE_NAME_SIZE));
+		if (opts->format == OUT_STREAM) {
+			out = stdout;
+		} else if (!(out = fopen(args[i], "w+"))) {
+			perror("Error opening file");
+			ret = EXIT_FAILURE;
+			continue;
+		} else {
+			printf("%s\n", args[i]);
+		}
+		if ((opts->format == OUT_PNG ? convert_to_png(screen_rows, &screen, scrfile, out, opts, opts->arena)
+				: convert_to_raw(screen_rows, &screen, scrfile, out, opts->format, opts->arena)) == EXIT_FAILURE) {
+			fprintf(stderr, "Error writing %s\n", args[i]);
+			ret = EXIT_FAILURE;
+		}
+		if (out != stdout) fclose(out);
+	}
+
+	fflush(stdout);
+	return ret;
+}
+
+/*
+ * row_handler doing nothing, to time decoding only
+ */
+int skip_row(void *data, unsigned char *row) {
+	(void) data;
+	(void) row;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Returns the seconds it takes to decode buf BENCH_ROUNDS times with the given expand
+ */
+double bench_decode(pixelrun *buf, unsigned int nruns, imgdata_file *imgfile, unsigned char *row, void (*expand)(unsigned char *, pixelrun *, unsigned int)) {
+	struct timeval start, end;
+	int r;
+
+	gettimeofday(&start, NULL);
+	for (r = 0; r < BENCH_ROUNDS; ++r) {
+		decode_rows(buf, nruns, imgfile->imgwidth, row, expand, skip_row, NULL);
+	}
+	gettimeofday(&end, NULL);
+
+	return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+}
+
+/*
+ * Decodes every content a number of times, without writing anything,
+ * and prints the decoded pixels/s of the vectorized and the scalar kernel
+ * and the time checking the runs takes as percentage of decoding
+ */
+void bench_contents(imgdata *img, arena *run) {
+	imgdata_file *imgs = img->files;
+	arena scratch;
+	pixelrun *buf;
+	unsigned char *row;
+	unsigned int i, nruns;
+	double vtime, stime, ctime, vtotal = 0, stotal = 0, ctotal = 0, pixels, ptotal = 0;
+	struct timeval start, end;
+	int r;
+
+	arena_init(&scratch, 0);
+	printf("%-16s\t%s\t%s\t%s\t%s\n", "name", "pixels", "Mpx/s", "scalar Mpx/s", "check %");
+	for (i = 0; i < img->hdr.num_files; ++i) {
+		arena_reset(&scratch);
+		buf = imgdata_runs(img, i, &nruns);
+		row = arena_alloc(&scratch, (size_t) imgs[i].imgwidth * 3 + 1);
+		if (buf == NULL || row == NULL) {
+			printf("Error reading %.*s\n", IMGDATA_FILE_NAME_SIZE, imgs[i].name);
+			continue;
+		}
+
+		vtime = bench_decode(buf, nruns, &imgs[i], row, expand_run);
+		stime = bench_decode(buf, nruns, &imgs[i], row, expand_run_scalar);
+		/* what checking the runs (done once per content by imgdata_runs) adds to decoding */
+		gettimeofday(&start, NULL);
+		for (r = 0; r < BENCH_ROUNDS; ++r) {
+			check_runs(buf, nruns, imgs[i].imgwidth, imgs[i].imgheight);
+		}
+		gettimeofday(&end, NULL);
+		ctime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+		pixels = (double) imgs[i].imgwidth * imgs[i].imgheight * BENCH_ROUNDS;
+		printf("%-16.*s\t%u\t%.1f\t%.1f\t%.1f\n", IMGDATA_FILE_NAME_SIZE, imgs[i].name, imgs[i].imgwidth * imgs[i].imgheight,
+			vtime > 0 ? pixels / vtime / 1000000 : 0.0, stime > 0 ? pixels / stime / 1000000 : 0.0,
+			vtime > 0 ? 100 * ctime / vtime : 0.0);
+		vtotal += vtime;
+		stotal += stime;
+		ctotal += ctime;
+		ptotal += pixels;
+	}
+	arena_free(&scratch, run);
+	printf("%-16s\t%.0f\t%.1f\t%.1f\t%.1f\n", "total", ptotal / BENCH_ROUNDS,
+		vtotal > 0 ? ptotal / vtotal / 1000000 : 0.0, stotal > 0 ? ptotal / stotal / 1000000 : 0.0,
+		vtotal > 0 ? 100 * ctotal / vtotal : 0.0);
+}
+
+/*
+ * Parses the given file(name)s for their coords (and size)
+ * A MARK_* is put in the arg.mark for each changing value
+ */
+void parse_args(unsigned int count, char *args[], arg ifile[]) {
+	int i, max;
+	char *str, *dot;
+
+	for (i = 0; i < count; ++i) {
+		ifile[i].mark = 0;
+		/* skipped entries stay empty */
+		ifile[i].name[0] = '\0';
+		ifile[i].content = NULL;
+		ifile[i].size = ifile[i].bsize = ifile[i].lsize = 0;
+		str = strtok(args[i], ":");
+		dot = strrchr(args[i], '.');
+		max = sizeof(ifile[i].name) - 1;
+		if ((dot != NULL && dot - args[i] > IMGDATA_FILE_NAME_SIZE) ||
+			(str != NULL && strlen(str) > max) ||
+			(dot == NULL && str != NULL && strlen(str) > IMGDATA_FILE_NAME_SIZE)
+		) {
+			printf("Filename %s too long, skipping\n", str);
+			continue;
 		}
 		strncpy(ifile[i].name, str, max);
 		ifile[i].name[max] = '\0';
@@ -470,244 +1610,739 @@ void parse_args(unsigned int count, char *args[], arg ifile[]) {
 }
 
 /*
- * Updates the header with new coords and sizes
+ * Updates the header with new coords and sizes
+ */
+void update_header(imgdata_file *imgs, unsigned int icount, arg ufile[], unsigned int ucount) {
+	int i, j, offchange = 0;
+	char uname[IMGDATA_FILE_NAME_SIZE + 1];
+
+	/* loop over packed imgs */
+	for (j = 0; j < icount; ++j) {
+		/* add or subtract possible offset change */
+		imgs[j].offset += offchange;
+
+		/* loop over parsed imgs */
+		for (i = 0; i < ucount; ++i) {
+			/* can't use strlen on imgs[j].name as it's uncertain it's nullterminated */
+			arg_imgname(&ufile[i], uname);
+			if (!strncmp(uname, imgs[j].name, IMGDATA_FILE_NAME_SIZE)) {
+				if (ufile[i].mark & MARK_X) {
+					imgs[j].scrxpos = ufile[i].x;
+				}
+				if (ufile[i].mark & MARK_Y) {
+					imgs[j].scrypos = ufile[i].y;
+				}
+				if (ufile[i].mark & MARK_W) {
+					imgs[j].imgwidth = ufile[i].w;
+				}
+				if (ufile[i].mark & MARK_H) {
+					imgs[j].imgheight = ufile[i].h;
+				}
+				if (ufile[i].mark & MARK_S) {
+					/* if different amount of blocks are used, update offchange
+					 * old size can be 0 when adding a new image */
+					offchange += (int) block_size(ufile[i].size) - (int) block_size(imgs[j].size);
+					imgs[j].size = ufile[i].size;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Parses the given file and extracts the size and converts the image to the imgdata format
+ * Colors up to maxerr apart are merged into one run, see merge_colors
+ * The content is allocated from run, the decoded pixels from scratch
+ * Width, height and size are only marked once the content is encoded, so a skipped
+ * file leaves the arg as parse_args made it
+ * Returns EXIT_FAILURE if the file is skipped
+ */
+int parse_png_file(arg *ufile, unsigned int maxerr, arena *run, arena *scratch) {
+	int num = PNG_SIG_SIZE;
+	png_byte header[PNG_SIG_SIZE];
+	FILE *fp;
+	png_structp png_ptr;
+	png_infop info_ptr;
+	png_color_16 my_background = {0, 0, 0, 0, 0};
+	png_color_16p image_background;
+	png_uint_32 width= 0, height = 0;
+	png_byte color_type = 0;
+	png_byte bit_depth = 0;
+	png_bytep pixels;
+	png_bytep *rows;
+
+	if (ufile->name[0] == '\0') {
+		return EXIT_FAILURE;
+	}
+	if (!(fp = fopen(ufile->name, "rb"))) {
+		printf("Problem opening file %s, skipping: %s\n", ufile->name, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (fread(header, 1, num, fp) <= 0) {
+		printf("Problem reading file %s, skipping: %s\n", ufile->name, strerror(errno));
+		fclose(fp);
+		return EXIT_FAILURE;
+	}
+	if (png_sig_cmp(header, 0, num)) {
+		printf("Problem reading file %s, skipping: not a PNG file\n", ufile->name);
+		fclose(fp);
+		return EXIT_FAILURE;
+	}
+
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr) {
+		printf("Problem creating PNG structs for %s, skipping\n", ufile->name);
+		fclose(fp);
+		return EXIT_FAILURE;
+	}
+
+
+	info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr) {
+		printf("Problem creating PNG structs for %s, skipping\n", ufile->name);
+		png_destroy_read_struct(&png_ptr, NULL, NULL);
+		fclose(fp);
+		return EXIT_FAILURE;
+	}
+
+	/* libpng jumps back here on a broken PNG */
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		printf("Problem decoding %s, skipping\n", ufile->name);
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		fclose(fp);
+		return EXIT_FAILURE;
+	}
+
+	png_init_io(png_ptr, fp);
+	png_set_sig_bytes(png_ptr, num);
+	png_set_user_limits(png_ptr, IMGDATA_MAX_DIMENSION, IMGDATA_MAX_DIMENSION);
+
+	png_read_info(png_ptr, info_ptr);
+
+	/* Clear alpa channel by making it black */
+	if (png_get_bKGD(png_ptr, info_ptr, &image_background)) {
+		png_set_background(png_ptr, image_background, PNG_BACKGROUND_GAMMA_FILE, 1, 1.0);
+	} else {
+		png_set_background(png_ptr, &my_background, PNG_BACKGROUND_GAMMA_SCREEN, 0, 1.0);
+	}
+
+	/* get width and height, they are set along with the content */
+	width = png_get_image_width(png_ptr, info_ptr);
+	height = png_get_image_height(png_ptr, info_ptr);
+
+	/* transform PNG to RGB with 8bit depth */
+	color_type = png_get_color_type(png_ptr, info_ptr);
+	bit_depth= png_get_bit_depth(png_ptr, info_ptr);
+	if (color_type == PNG_COLOR_TYPE_PALETTE) {
+		png_set_palette_to_rgb(png_ptr);
+	}
+	if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+		png_set_gray_to_rgb(png_ptr);
+		if(bit_depth < 8) {
+			png_set_expand_gray_1_2_4_to_8(png_ptr);
+		}
+	}
+	if (bit_depth == 16) {
+		png_set_strip_16(png_ptr);
+	}
+
+	png_read_update_info(png_ptr, info_ptr);
+
+	/* get pixels and transform to imgdata format */
+	if (height > 0 && width > 0) {
+		unsigned int j, l;
+		/* should be width * 3 */
+		int bwidth = png_get_rowbytes(png_ptr,info_ptr);
+
+		if (bwidth != width * 3) {
+			printf("Problem converting %s to RGB, skipping\n", ufile->name);
+			png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+			fclose(fp);
+			return EXIT_FAILURE;
+		}
+
+		/* all rows in one block, so runs can be found across rows */
+		arena_reserve(scratch, (size_t) height * bwidth + height * sizeof(png_bytep) + ARENA_ALIGN);
+		pixels = arena_alloc(scratch, (size_t) height * bwidth);
+		rows = arena_alloc(scratch, height * sizeof(png_bytep));
+		if (pixels == NULL || rows == NULL) {
+			printf("Failed to allocate memory for %s: %s\n", ufile->name, strerror(errno));
+			png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+			fclose(fp);
+			return EXIT_FAILURE;
+		}
+		for (j = 0; j < height; ++j) {
+			rows[j] = pixels + (size_t) j * bwidth;
+		}
+		png_read_image(png_ptr, rows);
+
+		/* count the runs first, so the content is allocated once at its final size */
+		l = encode_runs(pixels, width * height, NULL);
+		ufile->lsize = l * sizeof(pixelrun);
+		if (maxerr > 0) {
+			merge_colors(pixels, width * height, maxerr);
+			l = encode_runs(pixels, width * height, NULL);
+		}
+		ufile->size = l * sizeof(pixelrun);
+		ufile->bsize = block_size(ufile->size);
+		/* zeroed remainder of block for niceness */
+		ufile->content = arena_zalloc(run, ufile->bsize);
+		if (ufile->content == NULL) {
+			printf("Failed to allocate memory for %s: %s\n", ufile->name, strerror(errno));
+			png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+			fclose(fp);
+			return EXIT_FAILURE;
+		}
+		encode_runs(pixels, width * height, ufile->content);
+		ufile->w = (unsigned int) width;
+		ufile->h = (unsigned int) height;
+		ufile->mark |= MARK_W | MARK_H | MARK_S;
+	}
+
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	fclose(fp);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Worker of the -j pool, parses files until none are left
+ * Pixels go in the worker's own arena, emptied after every file
  */
-void update_header(imgdata_file *imgs, unsigned int icount, arg ufile[], unsigned int ucount) {
-	int i, j, check, offchange = 0;
-	char *dot;
-	char uname[IMGDATA_FILE_NAME_SIZE + 1];
+void *parse_worker(void *data) {
+	parse_pool *pool = data;
+	arena scratch;
+	unsigned int i;
+
+	arena_init(&scratch, 0);
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (i >= pool->count) {
+			break;
+		}
+		if (parse_png_file(&pool->ufile[i], pool->maxerr, pool->run, &scratch) == EXIT_FAILURE) {
+			pthread_mutex_lock(&pool->lock);
+			++pool->failed;
+			pthread_mutex_unlock(&pool->lock);
+		}
+		arena_reset(&scratch);
+	}
 
-	/* loop over packed imgs */
-	for (j = 0; j < icount; ++j) {
-		/* add or subtract possible offset change */
-		imgs[j].offset += offchange;
+	arena_free(&scratch, pool->run);
+	return NULL;
+}
 
-		/* loop over parsed imgs */
-		for (i = 0; i < ucount; ++i) {
-			/* can't use strlen on imgs[j].name as it's uncertain it's nullterminated */
-			dot = strrchr(ufile[i].name, '.');
-			check = IMGDATA_FILE_NAME_SIZE;
-			if (dot != NULL && dot - ufile[i].name < check) {
-				check = dot - ufile[i].name;
-			}
-			strncpy(uname, ufile[i].name, check);
-			uname[check] = '\0';
-			if (!strncmp(uname, imgs[j].name, IMGDATA_FILE_NAME_SIZE)) {
-				if (ufile[i].mark & MARK_X) {
-					imgs[j].scrxpos = ufile[i].x;
-				}
-				if (ufile[i].mark & MARK_Y) {
-					imgs[j].scrypos = ufile[i].y;
-				}
-				if (ufile[i].mark & MARK_W) {
-					imgs[j].imgwidth = ufile[i].w;
-				}
-				if (ufile[i].mark & MARK_H) {
-					imgs[j].imgheight = ufile[i].h;
-				}
-				if (ufile[i].mark & MARK_S) {
-					/* get how many blocks were used and are used now */
-					int iblks, ublks;
-					/* iblks can be 0 when adding a new image */
-					iblks = imgs[j].size == 0 ? 0 : (imgs[j].size / IMGDATA_FILE_BLOCK_SIZE) + 1;
-					ublks = (ufile[i].size / IMGDATA_FILE_BLOCK_SIZE) + 1;
-					/* if different amount of blocks are used, update offchange */
-					if (ublks - iblks) {
-						offchange += (IMGDATA_FILE_BLOCK_SIZE * (ublks - iblks));
-					}
-					imgs[j].size = ufile[i].size;
-				}
+/*
+ * Parses the given files and extracts the size and converts the image to the imgdata format
+ * Files are parsed opts->jobs at the same time, each only touches its own arg,
+ * so the layout made from them afterwards doesn't depend on the order they finish in
+ * Returns EXIT_FAILURE if any file was skipped
+ */
+int parse_png_files(unsigned int count, arg ufile[], tool_opts *opts) {
+	parse_pool pool;
+	pthread_t *threads;
+	unsigned int i, started, jobs = opts->jobs < count ? opts->jobs : count;
+
+	pool.ufile = ufile;
+	pool.run = opts->arena;
+	pool.maxerr = opts->maxerr;
+	pool.count = count;
+	pool.next = 0;
+	pool.failed = 0;
+	threads = arena_alloc(opts->arena, (jobs > 1 ? jobs : 1) * sizeof(pthread_t));
+	pthread_mutex_init(&pool.lock, NULL);
+	for (started = 0; jobs > 1 && threads != NULL && started < jobs; ++started) {
+		if (pthread_create(&threads[started], NULL, parse_worker, &pool)) {
+			break;
+		}
+	}
+	/* if no thread could be started, do the work ourselves */
+	if (started == 0) {
+		parse_worker(&pool);
+	}
+	for (i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&pool.lock);
+
+	return pool.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Packs the given PNGs like -c, but with equal contents stored once, and reports the result
+ * path is only created when the result fits, and never when it is NULL (-n)
+ * Returns EXIT_FAILURE if the result does not fit or could not be written
+ */
+int pack_files(char *path, unsigned int count, char *args[], tool_opts *opts) {
+	FILE *img;
+	imgdatahdr bimg;
+	imgdata_file *imgs = NULL;
+	arg *ufile;
+	int *shared, ret;
+	unsigned long long total;
+
+	ufile = arena_alloc(opts->arena, count * sizeof(arg));
+	shared = arena_alloc(opts->arena, count * sizeof(int));
+	if (ufile == NULL || shared == NULL) {
+		printf("Failed to allocate memory: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	parse_args(count, args, ufile);
+	if (parse_png_files(count, ufile, opts) == EXIT_FAILURE) {
+		if (path != NULL) {
+			printf("Nothing written\n");
+		}
+		return EXIT_FAILURE;
+	}
+
+	create_file_header(&bimg, &imgs, count, ufile, opts->arena);
+	if (imgs == NULL) {
+		return EXIT_FAILURE;
+	}
+	update_header(imgs, count, ufile, count);
+	total = share_contents(imgs, count, ufile, shared);
+
+	ret = pack_report(imgs, count, ufile, shared, total, opts);
+	if (path != NULL && ret == EXIT_FAILURE) {
+		printf("Nothing written\n");
+	} else if (path != NULL) {
+		if (!(img = fopen(path, "wb"))) {
+			perror("Error opening file");
+			ret = EXIT_FAILURE;
+		} else {
+			if (write_file_header(img, &bimg, &imgs, opts->arena) == EXIT_FAILURE) {
+				printf("An error occured writing the new header information\n");
+				ret = EXIT_FAILURE;
+			} else if (write_file_args(img, ufile, count) == EXIT_FAILURE) {
+				printf("An error occured writing the new image file\n");
+				ret = EXIT_FAILURE;
 			}
+			fclose(img);
 		}
 	}
+
+	return ret;
 }
 
 /*
- * Parses the given files and extracts the size and converts the image to the imgdata format
+ * Reads the "file1.png X Y" lines of manifest into file1.png:X:Y arguments like those of -c, from run
+ * Empty lines and lines starting with # are skipped
+ * Returns EXIT_FAILURE if it can't be read or a line is no entry
  */
-void parse_png_files(unsigned int count, arg ufile[]) {
-	int i, num = 8;
-	png_byte header[num];
+int read_manifest(char *manifest, char ***args, unsigned int *count, arena *run) {
 	FILE *fp;
-	png_structp png_ptr;
-	png_infop info_ptr;
-	png_color_16 my_background = {0, 0, 0, 0, 0};
-	png_color_16p image_background;
-	png_uint_32 width= 0, height = 0;
-	png_byte color_type = 0;
-	png_byte bit_depth = 0;
+	char line[MANIFEST_LINE_SIZE], name[MANIFEST_LINE_SIZE], x[MANIFEST_LINE_SIZE], y[MANIFEST_LINE_SIZE], more;
+	unsigned int lines = 0, lineno = 0;
+	int ret = EXIT_SUCCESS;
 
-	for (i = 0; i < count; ++i) {
-		if (!(fp = fopen(ufile[i].name, "rb"))) {
-			printf("Problem opening file %s, skipping: %s\n", ufile[i].name, strerror(errno));
-			continue;
-		}
+	if (!(fp = fopen(manifest, "r"))) {
+		printf("Problem opening manifest %s: %s\n", manifest, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	/* lines first, so the arguments are allocated once */
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lines++;
+	}
+	rewind(fp);
+	*count = 0;
+	if ((*args = arena_alloc(run, (lines ? lines : 1) * sizeof(char *))) == NULL) {
+		printf("Failed to allocate memory: %s\n", strerror(errno));
+		fclose(fp);
+		return EXIT_FAILURE;
+	}
 
-		if (fread(header, 1, num, fp) <= 0) {
-			printf("Problem reading file %s, skipping: %s\n", ufile[i].name, strerror(errno));
-			fclose(fp);
+	while (ret == EXIT_SUCCESS && *count < lines && fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if (strchr(line, '\n') == NULL && !feof(fp)) {
+			printf("%s:%u: line too long\n", manifest, lineno);
+			ret = EXIT_FAILURE;
+		} else if (sscanf(line, " %c", &more) != 1 || more == '#') {
 			continue;
+		} else if (sscanf(line, "%s %s %s %c", name, x, y, &more) != 3) {
+			printf("%s:%u: expected \"file1.png X Y\"\n", manifest, lineno);
+			ret = EXIT_FAILURE;
+		} else if (((*args)[*count] = arena_alloc(run, strlen(name) + strlen(x) + strlen(y) + 3)) == NULL) {
+			printf("Failed to allocate memory: %s\n", strerror(errno));
+			ret = EXIT_FAILURE;
+		} else {
+			sprintf((*args)[(*count)++], "%s:%s:%s", name, x, y);
 		}
-		if (png_sig_cmp(header, 0, num)) {
-			printf("Problem reading file %s, skipping: not a PNG file\n", ufile[i].name);
-			fclose(fp);
-			continue;
+	}
+	fclose(fp);
+
+	return ret;
+}
+
+/*
+ * Puts the FNV-1a hash of the file at path in hash
+ * Returns EXIT_FAILURE if it can't be read
+ */
+int hash_file(const char *path, unsigned long long *hash) {
+	unsigned char buf[MOVE_BUFFER_SIZE];
+	ssize_t got;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return EXIT_FAILURE;
+	}
+	*hash = FNV_OFFSET;
+	while ((got = read(fd, buf, sizeof(buf))) > 0) {
+		*hash = fnv1a(*hash, buf, got);
+	}
+	close(fd);
+
+	return got < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Loads the sidecar at path in cache, from run, the runs stay where they are in the loaded file
+ * A missing or foreign sidecar loads as empty, a truncated one up to the last whole entry,
+ * which only costs encoding those PNGs again
+ */
+void runcache_load(const char *path, runcache *cache, arena *run) {
+	struct stat st;
+	runcache_hdr hdr;
+	runcache_entry *e;
+	unsigned char *buf, *p, *end;
+	unsigned int i;
+	int fd;
+
+	cache->count = 0;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return;
+	}
+	if (fstat(fd, &st) || st.st_size < runcache_hdr_size || (buf = arena_alloc(run, st.st_size)) == NULL
+			|| pread(fd, buf, st.st_size, 0) != st.st_size) {
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	runcache_hdr_decode(&hdr, buf);
+	if (memcmp(hdr.magic, RUNCACHE_MAGIC, RUNCACHE_MAGIC_SIZE) || hdr.version != RUNCACHE_VERSION
+			|| hdr.count > (st.st_size - runcache_hdr_size) / runcache_entry_size) {
+		return;
+	}
+	cache->entries = arena_alloc(run, hdr.count * sizeof(runcache_entry) + 1);
+	cache->runs = arena_alloc(run, hdr.count * sizeof(unsigned char *) + 1);
+	if (cache->entries == NULL || cache->runs == NULL) {
+		return;
+	}
+
+	p = buf + runcache_hdr_size;
+	end = buf + st.st_size;
+	for (i = 0; i < hdr.count && end - p >= runcache_entry_size; ++i) {
+		e = &cache->entries[i];
+		runcache_entry_decode(e, p);
+		p += runcache_entry_size;
+		e->name[sizeof(e->name) - 1] = '\0';
+		if (e->bsize > end - p || e->bsize != block_size(e->size) || e->size % sizeof(pixelrun)) {
+			break;
 		}
+		cache->runs[i] = p;
+		p += e->bsize;
+	}
+	cache->count = i;
+}
 
-		png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-		if (!png_ptr) {
-			printf("Problem creating PNG structs for %s, skipping\n", ufile[i].name);
-			fclose(fp);
-			continue;
+/*
+ * Takes the content of ufile from cache if its PNG is the one the runs were encoded from with maxerr
+ * stamp gets what the sidecar keeps of the PNG, the PNG is only hashed when its mtime or size changed
+ * Returns EXIT_FAILURE on a miss, the PNG has to be encoded
+ */
+int runcache_fetch(runcache *cache, arg *ufile, runcache_entry *stamp, unsigned int maxerr) {
+	struct stat st;
+	runcache_entry *e = NULL;
+	unsigned long long hash;
+	unsigned int i;
+
+	memset(stamp, 0, sizeof(runcache_entry));
+	/* parse_png_file reports what is wrong with it */
+	if (ufile->name[0] == '\0' || stat(ufile->name, &st)) {
+		return EXIT_FAILURE;
+	}
+	strncpy(stamp->name, ufile->name, sizeof(stamp->name) - 1);
+	stamp->mtime = st.st_mtim.tv_sec;
+	stamp->mtime_nsec = st.st_mtim.tv_nsec;
+	stamp->fsize = st.st_size;
+	stamp->maxerr = maxerr;
+
+	for (i = 0; i < cache->count; ++i) {
+		if (!strcmp(cache->entries[i].name, stamp->name)) {
+			e = &cache->entries[i];
+			break;
+		}
+	}
+	if (e != NULL && e->mtime == stamp->mtime && e->mtime_nsec == stamp->mtime_nsec && e->fsize == stamp->fsize) {
+		stamp->hash_lo = e->hash_lo;
+		stamp->hash_hi = e->hash_hi;
+	} else if (hash_file(ufile->name, &hash) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	} else {
+		/* touched, e.g. by a checkout, but maybe not changed */
+		stamp->hash_lo = (unsigned int) hash;
+		stamp->hash_hi = (unsigned int) (hash >> 32);
+		if (e == NULL || e->fsize != stamp->fsize || e->hash_lo != stamp->hash_lo || e->hash_hi != stamp->hash_hi) {
+			return EXIT_FAILURE;
 		}
+	}
+	if (e->maxerr != maxerr
+			|| check_runs((pixelrun *) cache->runs[i], e->size / sizeof(pixelrun), e->width, e->height) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
 
+	ufile->w = e->width;
+	ufile->h = e->height;
+	ufile->size = e->size;
+	ufile->lsize = e->lsize;
+	ufile->bsize = e->bsize;
+	/* already padded to the block as in imgdata.img */
+	ufile->content = (pixelrun *) cache->runs[i];
+	ufile->mark |= MARK_W | MARK_H | MARK_S;
 
-		info_ptr = png_create_info_struct(png_ptr);
-		if (!info_ptr) {
-			printf("Problem creating PNG structs for %s, skipping\n", ufile[i].name);
-			png_destroy_read_struct(&png_ptr, NULL, NULL);
-			fclose(fp);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Writes the sidecar at path with the runs of the count encoded files of ufile and their stamps,
+ * to a temporary file renamed over it when complete
+ * Returns EXIT_FAILURE if it could not be written, the next build then encodes all PNGs again
+ */
+int runcache_store(const char *path, arg ufile[], runcache_entry stamps[], unsigned int count, arena *run) {
+	FILE *fp;
+	char *tmp;
+	unsigned char hdrbuf[runcache_hdr_size], buf[runcache_entry_size];
+	runcache_hdr hdr;
+	unsigned int i;
+	int ret = EXIT_SUCCESS;
+
+	memcpy(hdr.magic, RUNCACHE_MAGIC, RUNCACHE_MAGIC_SIZE);
+	hdr.version = RUNCACHE_VERSION;
+	hdr.count = 0;
+	for (i = 0; i < count; ++i) {
+		if (ufile[i].content != NULL && stamps[i].name[0] != '\0') {
+			hdr.count++;
+		}
+	}
+
+	if ((tmp = arena_alloc(run, strlen(path) + 5)) == NULL) {
+		return EXIT_FAILURE;
+	}
+	sprintf(tmp, "%s.tmp", path);
+	if (!(fp = fopen(tmp, "wb"))) {
+		return EXIT_FAILURE;
+	}
+	runcache_hdr_encode(hdrbuf, &hdr);
+	if (fwrite(hdrbuf, runcache_hdr_size, 1, fp) != 1) {
+		ret = EXIT_FAILURE;
+	}
+	for (i = 0; i < count && ret == EXIT_SUCCESS; ++i) {
+		if (ufile[i].content == NULL || stamps[i].name[0] == '\0') {
 			continue;
 		}
+		stamps[i].width = ufile[i].w;
+		stamps[i].height = ufile[i].h;
+		stamps[i].size = ufile[i].size;
+		stamps[i].lsize = ufile[i].lsize;
+		stamps[i].bsize = ufile[i].bsize;
+		runcache_entry_encode(buf, &stamps[i]);
+		if (fwrite(buf, runcache_entry_size, 1, fp) != 1 || fwrite(ufile[i].content, ufile[i].bsize, 1, fp) != 1) {
+			ret = EXIT_FAILURE;
+		}
+	}
+	if (fclose(fp) || ret == EXIT_FAILURE || rename(tmp, path)) {
+		unlink(tmp);
+		return EXIT_FAILURE;
+	}
 
-		png_init_io(png_ptr, fp);
-		png_set_sig_bytes(png_ptr, num);
+	return EXIT_SUCCESS;
+}
 
-		png_read_info(png_ptr, info_ptr);
+/*
+ * Builds path like -c from the entries of manifest, taking the runs of PNGs that did not
+ * change since the last build from the sidecar <path>.runs instead of encoding them again
+ * Returns EXIT_FAILURE if the manifest is invalid or path could not be written
+ */
+int build_files(char *path, char *manifest, tool_opts *opts) {
+	FILE *img;
+	imgdatahdr bimg;
+	imgdata_file *imgs = NULL;
+	char **args, *sidecar;
+	arg *ufile, *todo;
+	runcache cache;
+	runcache_entry *stamps;
+	unsigned int count, ntodo = 0, i, j;
+	int ret = EXIT_SUCCESS;
+
+	if (read_manifest(manifest, &args, &count, opts->arena) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	ufile = arena_alloc(opts->arena, count * sizeof(arg) + 1);
+	todo = arena_alloc(opts->arena, count * sizeof(arg) + 1);
+	stamps = arena_alloc(opts->arena, count * sizeof(runcache_entry) + 1);
+	sidecar = arena_alloc(opts->arena, strlen(path) + sizeof(RUNCACHE_SUFFIX));
+	if (ufile == NULL || todo == NULL || stamps == NULL || sidecar == NULL) {
+		printf("Failed to allocate memory: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	sprintf(sidecar, "%s%s", path, RUNCACHE_SUFFIX);
+	parse_args(count, args, ufile);
 
-		/* Clear alpa channel by making it black */
-		if (png_get_bKGD(png_ptr, info_ptr, &image_background)) {
-			png_set_background(png_ptr, image_background, PNG_BACKGROUND_GAMMA_FILE, 1, 1.0);
-		} else {
-			png_set_background(png_ptr, &my_background, PNG_BACKGROUND_GAMMA_SCREEN, 0, 1.0);
-		}
-
-		/* get and set width and height */
-		width = png_get_image_width(png_ptr, info_ptr);
-		height = png_get_image_height(png_ptr, info_ptr);
-		ufile[i].w = (unsigned int) width;
-		ufile[i].mark += MARK_W;
-		ufile[i].h = (unsigned int) height;
-		ufile[i].mark += MARK_H;
-
-		/* transform PNG to RGB with 8bit depth */
-		color_type = png_get_color_type(png_ptr, info_ptr);
-		bit_depth= png_get_bit_depth(png_ptr, info_ptr);
-		if (color_type == PNG_COLOR_TYPE_PALETTE) {
-			png_set_palette_to_rgb(png_ptr);
-		}
-		if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
-			png_set_gray_to_rgb(png_ptr);
-			if(bit_depth < 8) {
-				png_set_expand_gray_1_2_4_to_8(png_ptr);
-			}
+	/* only the PNGs the sidecar has no runs for are encoded, -j of them at the same time */
+	runcache_load(sidecar, &cache, opts->arena);
+	for (i = 0; i < count; ++i) {
+		if (runcache_fetch(&cache, &ufile[i], &stamps[i], opts->maxerr) == EXIT_FAILURE) {
+			todo[ntodo++] = ufile[i];
 		}
-		if (bit_depth == 16) {
-			png_set_strip_16(png_ptr);
+	}
+	if (parse_png_files(ntodo, todo, opts) == EXIT_FAILURE) {
+		printf("Nothing written\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0, j = 0; i < count && j < ntodo; ++i) {
+		if (ufile[i].content == NULL) {
+			ufile[i] = todo[j++];
 		}
+	}
+	printf("%u of %u PNGs encoded, %u taken from %s\n", ntodo, count, count - ntodo, sidecar);
 
-		png_read_update_info(png_ptr, info_ptr);
+	create_file_header(&bimg, &imgs, count, ufile, opts->arena);
+	if (imgs == NULL) {
+		return EXIT_FAILURE;
+	}
+	update_header(imgs, count, ufile, count);
+	if (!(img = fopen(path, "wb"))) {
+		perror("Error opening file");
+		return EXIT_FAILURE;
+	}
+	if (write_file_header(img, &bimg, &imgs, opts->arena) == EXIT_FAILURE) {
+		printf("An error occured writing the new header information\n");
+		ret = EXIT_FAILURE;
+	} else if (write_file_args(img, ufile, count) == EXIT_FAILURE) {
+		printf("An error occured writing the new image file\n");
+		ret = EXIT_FAILURE;
+	}
+	if (fclose(img)) {
+		ret = EXIT_FAILURE;
+	}
+	if (ret == EXIT_SUCCESS && runcache_store(sidecar, ufile, stamps, count, opts->arena) == EXIT_FAILURE) {
+		printf("Problem writing %s, the next build encodes all PNGs again\n", sidecar);
+	}
 
-		/* get pixels and transform to imgdata format */
-		if (height > 0 && width > 0) {
-			png_bytep rows[height];
-			int j, k, l = 0, blockcount = 1;
-			unsigned int prsize = sizeof(pixelrun);
-			/* should be width * 3 */
-			int bwidth = png_get_rowbytes(png_ptr,info_ptr);
+	return ret;
+}
 
-			for (j = 0; j < height; ++j) {
-				rows[j] = malloc(bwidth);
-			}
-			png_read_image(png_ptr, rows);
-
-			/* start with 1 block, realloc if more needed */
-			ufile[i].content = malloc(IMGDATA_FILE_BLOCK_SIZE);
-
-			/* init first pixelrun */
-			if (height > 0 && bwidth > 2) {
-				ufile[i].content[l].red = rows[0][0];
-				ufile[i].content[l].green = rows[0][1];
-				ufile[i].content[l].blue = rows[0][2];
-				/* count 0 as it'll be increased in the actual filling */
-				ufile[i].content[l].count = 0;
-			}
+/*
+ * Takes the options out of argv[2] and further, leaving the mode arguments in place
+ * Returns EXIT_FAILURE on an invalid option
+ */
+int parse_options(int *argc, char **argv, tool_opts *opts) {
+	int i, kept = 2;
+	char *name, *value, *last;
+	long jobs;
+
+	for (i = 2; i < *argc; ++i) {
+		name = argv[i];
+		if (!strcmp(name, "-M")) {
+			opts->memstats = 1;
+			continue;
+		}
+		if (name[0] != '-' || (name[1] != 'j' && name[1] != 'z' && name[1] != 'f' && name[1] != 'o' && name[1] != 'C'
+				&& name[1] != 'e' && name[1] != 'S') || name[2] != '\0') {
+			argv[kept++] = argv[i];
+			continue;
+		}
+		if (++i == *argc) {
+			return EXIT_FAILURE;
+		}
+		value = argv[i];
 
-			/* actual filling */
-			for (j = 0; j < height; ++j) {
-				for (k = 0; k < bwidth; k+=3) {
-					if (ufile[i].content[l].count != 255 &&
-						ufile[i].content[l].red == rows[j][k] &&
-						ufile[i].content[l].green == rows[j][k+1] &&
-						ufile[i].content[l].blue == rows[j][k+2]
-					) {
-						++(ufile[i].content[l].count);
-					} else {
-						++l;
-						if (IMGDATA_FILE_BLOCK_SIZE * blockcount <= l * prsize) {
-							++blockcount;
-							ufile[i].content = realloc(ufile[i].content, blockcount * IMGDATA_FILE_BLOCK_SIZE);
-						}
-						ufile[i].content[l].red = rows[j][k];
-						ufile[i].content[l].green = rows[j][k+1];
-						ufile[i].content[l].blue = rows[j][k+2];
-						ufile[i].content[l].count = 1;
-					}
-				}
+		if (name[1] == 'j') {
+			jobs = strtol(value, &last, 0);
+			if (*value == '\0' || *last != '\0' || jobs < 1 || jobs > MAX_JOBS) {
+				printf("Invalid number of jobs %s, use 1 to %d\n", value, MAX_JOBS);
+				return EXIT_FAILURE;
 			}
-			++l;
-			ufile[i].bsize = blockcount * IMGDATA_FILE_BLOCK_SIZE;
-			ufile[i].size = l * prsize;
-			ufile[i].mark += MARK_S;
-
-			/* zero remainder of block for niceness */
-			while (l * prsize < ufile[i].bsize) {
-				ufile[i].content[l].red = 0;
-				ufile[i].content[l].green = 0;
-				ufile[i].content[l].blue = 0;
-				ufile[i].content[l].count = 0;
-				++l;
+			opts->jobs = (unsigned int) jobs;
+		} else if (name[1] == 'z') {
+			opts->level = (int) strtol(value, NULL, 0);
+			if (opts->level < 0 || opts->level > 9) {
+				return EXIT_FAILURE;
 			}
-
-			/* cleanup */
-			for (j = 0; j < height; ++j) {
-				free(rows[j]);
+		} else if (name[1] == 'e') {
+			opts->maxerr = (unsigned int) strtol(value, NULL, 0);
+			if (opts->maxerr > 255) {
+				return EXIT_FAILURE;
+			}
+		} else if (name[1] == 'S') {
+			opts->partition = strtoull(value, NULL, 0);
+		} else if (name[1] == 'C') {
+			opts->cachedir = value;
+		} else if (name[1] == 'o') {
+			if (!strcmp(value, "png")) {
+				opts->format = OUT_PNG;
+			} else if (!strcmp(value, "ppm")) {
+				opts->format = OUT_PPM;
+			} else if (!strcmp(value, "raw")) {
+				opts->format = OUT_RAW;
+			} else if (!strcmp(value, "stream")) {
+				opts->format = OUT_STREAM;
+			} else {
+				return EXIT_FAILURE;
 			}
+		} else if (!strcmp(value, "none")) {
+			opts->filters = PNG_FILTER_NONE;
+		} else if (!strcmp(value, "sub")) {
+			opts->filters = PNG_FILTER_SUB;
+		} else if (!strcmp(value, "up")) {
+			opts->filters = PNG_FILTER_UP;
+		} else if (!strcmp(value, "avg")) {
+			opts->filters = PNG_FILTER_AVG;
+		} else if (!strcmp(value, "paeth")) {
+			opts->filters = PNG_FILTER_PAETH;
+		} else if (!strcmp(value, "all")) {
+			opts->filters = PNG_ALL_FILTERS;
+		} else {
+			return EXIT_FAILURE;
 		}
 	}
-}
+	*argc = kept;
 
-/*
- * Free the allocated memory for the content
- */
-void free_file_imgs(imgdata_content conts[], unsigned int count) {
-	while (count) {
-		if (conts[count - 1].content != NULL) {
-			free(conts[count - 1].content);
-		}
-		--count;
-	}
+	return EXIT_SUCCESS;
 }
 
 /*
- * Free the allocated memory for the given files
+ * Releases the run arena of opts, printing its use first for -M
+ * Returns ret
  */
-void free_file_args(arg ufile[], unsigned int count) {
-	while (count) {
-		if (ufile[count - 1].content != NULL) {
-			free(ufile[count - 1].content);
-		}
-		--count;
+int end_run(tool_opts *opts, int ret) {
+	if (opts->memstats) {
+		arena_report(opts->arena);
 	}
+	arena_free(opts->arena, NULL);
+	return ret;
 }
 
 int main(int argc, char **argv) {
 	FILE *img;
 	char fmode[4];
 	imgdatahdr bimg;
-	imgdata_file *imgs;
+	imgdata_file *imgs = NULL;
+	arg *ufile;
 	unsigned char mode = RUN_NONE;
-	unsigned int count = argc < 3 ? 0 : argc - 3;
+	unsigned int count;
+	int ret = EXIT_SUCCESS;
+	arena run;
+	tool_opts opts = {1, -1, PNG_FILTER_NONE, OUT_PNG, NULL, NULL, 0, IMGDATA_PARTITION_SIZE, &run, 0};
+
+	if (parse_options(&argc, argv, &opts) == EXIT_FAILURE) {
+		print_usage("invalid option given");
+		return EXIT_FAILURE;
+	}
+	count = argc < 3 ? 0 : argc - 3;
 
 	/* default mode is reading, set double \0 for "-u" needing mode rb+ */
 	strncpy(fmode, "rb", 4);
@@ -721,11 +2356,31 @@ int main(int argc, char **argv) {
 			print_usage("give one argument denoting the imgdata.img");
 		}
 	} else if (argv[1][0] == '-' && argv[1][1] == 'x' && argv[1][2] == '\0') {
+		mode = RUN_EXTRACT;
+	} else if (argv[1][0] == '-' && argv[1][1] == 'b' && argv[1][2] == '\0') {
 		if (argc == 3) {
-			mode = RUN_EXTRACT;
+			mode = RUN_BENCH;
 		} else {
 			print_usage("give one argument denoting the imgdata.img");
 		}
+	} else if (argv[1][0] == '-' && argv[1][1] == 's' && argv[1][2] == '\0') {
+		if (argc >= 4) {
+			mode = RUN_SCREEN;
+		} else {
+			print_usage("give one argument denoting the imgdata.img and one or more screens to render");
+		}
+	} else if (argv[1][0] == '-' && (argv[1][1] == 'p' || argv[1][1] == 'n') && argv[1][2] == '\0') {
+		if (argc >= 4) {
+			mode = argv[1][1] == 'p' ? RUN_PACK : RUN_DRYRUN;
+		} else {
+			print_usage("give one argument denoting the imgdata.img and one or more images to pack in it");
+		}
+	} else if (argv[1][0] == '-' && argv[1][1] == 'm' && argv[1][2] == '\0') {
+		if (argc == 4) {
+			mode = RUN_BUILD;
+		} else {
+			print_usage("give one argument denoting the imgdata.img and one denoting the manifest to build it from");
+		}
 	} else if (argv[1][0] == '-' && argv[1][1] == 'u' && argv[1][2] == '\0') {
 		if (argc >= 4) {
 			mode = RUN_UPDATE;
@@ -756,88 +2411,136 @@ int main(int argc, char **argv) {
 	if (mode == RUN_NONE) {
 		return EXIT_FAILURE;
 	}
+	arena_init(&run, 1);
+
+	/* modes only reading go through the mapping, contents are decoded where they are */
+	if (mode == RUN_LIST || mode == RUN_EXTRACT || mode == RUN_BENCH || mode == RUN_SCREEN) {
+		imgdata rimg;
+		unsigned int *which, wcount;
+
+		if (imgdata_open(argv[2], &rimg) == EXIT_FAILURE) {
+			print_usage("not a valid imgdata.img or bootloader.img");
+			return end_run(&opts, EXIT_FAILURE);
+		}
+		/* the selection and the -j pool, sized from the header */
+		arena_reserve(&run, (count + rimg.hdr.num_files) * (sizeof(unsigned int) + sizeof(int)) +
+			opts.jobs * sizeof(pthread_t) + 3 * ARENA_ALIGN);
+		if (mode == RUN_LIST) {
+			list_header_info(&rimg.hdr, rimg.files);
+		} else if (mode == RUN_BENCH) {
+			bench_contents(&rimg, &run);
+		} else if (mode == RUN_SCREEN) {
+			ret = render_screens(&rimg, count, &argv[3], &opts);
+		} else if (select_contents(&rimg, count, &argv[3], &which, &wcount, &run) == EXIT_FAILURE) {
+			ret = EXIT_FAILURE;
+		} else {
+			ret = extract_cached(&rimg, which, wcount, &opts);
+		}
+		imgdata_close(&rimg);
+		return end_run(&opts, ret);
+	}
+
+	/* the args, their header entries, the table read by -u/-r with its old copy and the -j pool,
+	 * contents get blocks sized from their PNG */
+	arena_reserve(&run, count * (sizeof(arg) + sizeof(int) + sizeof(imgdata_file) + imgdata_file_size) +
+		(mode == RUN_UPDATE || mode == RUN_REPLACE ? 2 * (IMGDATA_MAX_FILES * sizeof(imgdata_file) + 1) : 0) +
+		opts.jobs * sizeof(pthread_t) + 7 * ARENA_ALIGN);
+
+	/* <imgdata.img> is only created once the packed contents are known to fit, a dry run only reports */
+	if (mode == RUN_PACK || mode == RUN_DRYRUN) {
+		return end_run(&opts, pack_files(mode == RUN_PACK ? argv[2] : NULL, count, &argv[3], &opts));
+	}
+	if (mode == RUN_BUILD) {
+		return end_run(&opts, build_files(argv[2], argv[3], &opts));
+	}
+
+	/* the PNGs are parsed before <imgdata.img> is opened, so a skipped one leaves it untouched */
+	if ((ufile = arena_alloc(&run, count * sizeof(arg) + 1)) == NULL) {
+		printf("Failed to allocate memory: %s\n", strerror(errno));
+		return end_run(&opts, EXIT_FAILURE);
+	}
+	parse_args(count, &argv[3], ufile);
+	if (mode != RUN_UPDATE && parse_png_files(count, ufile, &opts) == EXIT_FAILURE) {
+		printf("Nothing written\n");
+		return end_run(&opts, EXIT_FAILURE);
+	}
 
 	if (!(img = fopen(argv[2], fmode))) {
 		perror("Error opening file");
-		return EXIT_FAILURE;
+		return end_run(&opts, EXIT_FAILURE);
 	}
 
 	switch (mode) {
-		case RUN_LIST:
-			if (read_file_header(img, &bimg, &imgs) == EXIT_FAILURE) {
-				print_usage("not a valid imgdata.img");
-			} else {
-				list_header_info(&bimg, imgs);
-			}
-			break;
-		case RUN_EXTRACT:
-			if (read_file_header(img, &bimg, &imgs) == EXIT_FAILURE) {
-				print_usage("not a valid imgdata.img");
-			} else {
-				extract_contents(img, bimg.num_files, imgs);
-			}
-			break;
 		case RUN_UPDATE:
-			if (read_file_header(img, &bimg, &imgs) == EXIT_FAILURE) {
+			if (read_file_header(img, &bimg, &imgs, arena_imgdata_alloc, &run) == EXIT_FAILURE) {
 				print_usage("not a valid imgdata.img");
-			} else {
-				arg ufile[count];
-				parse_args(count, &argv[3], ufile);
-				update_header(imgs, bimg.num_files, ufile, count);
-				if (write_file_header(img, &bimg, &imgs) == EXIT_FAILURE) {
-					printf("An error occured writing the updated header information\n");
-				}
+				ret = EXIT_FAILURE;
+				break;
+			}
+			update_header(imgs, bimg.num_files, ufile, count);
+			if (write_file_header(img, &bimg, &imgs, &run) == EXIT_FAILURE) {
+				printf("An error occured writing the updated header information\n");
+				ret = EXIT_FAILURE;
 			}
 			break;
 		case RUN_REPLACE:
-			if (read_file_header(img, &bimg, &imgs) == EXIT_FAILURE) {
+			if (read_file_header(img, &bimg, &imgs, arena_imgdata_alloc, &run) == EXIT_FAILURE) {
 				print_usage("not a valid imgdata.img");
+				ret = EXIT_FAILURE;
 			} else {
-				arg ufile[count];
-				imgdata_content conts[bimg.num_files];
-
-				parse_args(count, &argv[3], ufile);
-				parse_png_files(count, ufile);
-
-				if (read_file_imgs(img, bimg.num_files, imgs, conts) == EXIT_FAILURE) {
-					printf("An error occured getting the encoded content\n");
+				imgdata_file *old;
+				int inorder;
+
+				/* keep the old layout to know what moved */
+				old = arena_alloc(&run, bimg.num_files * sizeof(imgdata_file) + 1);
+				if (old == NULL) {
+					printf("Failed to allocate memory for the header: %s\n", strerror(errno));
+					ret = EXIT_FAILURE;
 				} else {
+					memcpy(old, imgs, bimg.num_files * sizeof(imgdata_file));
 					update_header(imgs, bimg.num_files, ufile, count);
-					if (write_file_header(img, &bimg, &imgs) == EXIT_FAILURE) {
-						printf("An error occured writing the updated header information\n");
-					} else if (write_file_imgs(img, conts, bimg.num_files, ufile, count) == EXIT_FAILURE) {
+					/* contents out of table order can't be shifted in place, they are all written again */
+					inorder = stored_in_order(old, bimg.num_files);
+					if (!inorder || has_shared(old, bimg.num_files)) {
+						layout_contents(old, imgs, bimg.num_files, ufile, count);
+					}
+					if ((inorder ? replace_file_imgs(img, old, imgs, bimg.num_files, ufile, count)
+							: rewrite_file_imgs(img, old, imgs, bimg.num_files, ufile, count, &run)) == EXIT_FAILURE) {
 						printf("An error occured writing the replaced image file\n");
+						ret = EXIT_FAILURE;
+					} else if (write_file_header(img, &bimg, &imgs, &run) == EXIT_FAILURE) {
+						printf("An error occured writing the updated header information\n");
+						ret = EXIT_FAILURE;
 					}
 				}
-				free_file_imgs(conts, bimg.num_files);
-				free_file_args(ufile, count);
 			}
 			break;
 		case RUN_CREATE:
-			{
-				arg ufile[count];
-				parse_args(count, &argv[3], ufile);
-				parse_png_files(count, ufile);
-
-				create_file_header(&bimg, &imgs, count, ufile);
-
-				update_header(imgs, count, ufile, count);
-				if (write_file_header(img, &bimg, &imgs) == EXIT_FAILURE) {
-					printf("An error occured writing the new header information\n");
-				} else if (write_file_args(img, ufile, count) == EXIT_FAILURE) {
-					printf("An error occured writing the new image file\n");
-				}
-				free_file_args(ufile, count);
+			create_file_header(&bimg, &imgs, count, ufile, &run);
+			if (imgs == NULL) {
+				ret = EXIT_FAILURE;
+				break;
+			}
+
+			update_header(imgs, count, ufile, count);
+			if (write_file_header(img, &bimg, &imgs, &run) == EXIT_FAILURE) {
+				printf("An error occured writing the new header information\n");
+				ret = EXIT_FAILURE;
+			} else if (write_file_args(img, ufile, count) == EXIT_FAILURE) {
+				printf("An error occured writing the new image file\n");
+				ret = EXIT_FAILURE;
 			}
 			break;
 		default:
 			print_usage("unknown mode to run in");
-			return EXIT_FAILURE;
+			fclose(img);
+			return end_run(&opts, EXIT_FAILURE);
 	}
 
-	/* Cleanup */
-	if (imgs != NULL) free(imgs);
-	fclose(img);
+	/* Cleanup, the header table is released with the arena */
+	if (fclose(img)) {
+		ret = EXIT_FAILURE;
+	}
 
-	return EXIT_SUCCESS;
+	return end_run(&opts, ret);
 }
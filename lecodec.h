@@ -0,0 +1,93 @@
+/*
+ * Initially developed at Ghent University as part of a masters thesis promoted
+ * by prof. dr. ir. Bjorn De Sutter of the Computer Systems Lab in cooperation with ir. Daan Raman from NVISO.
+ * Description: Little endian codecs for on-disk headers, generated from a table of their fields
+ * Usage: A field table is a macro taking U32 and BYTES, listing the fields in disk order:
+ *            #define FOO_FIELDS(U32, BYTES) BYTES(magic, 8) U32(size)
+ *            typedef struct { LECODEC_STRUCT(FOO_FIELDS) } foo;
+ *            LECODEC(foo, FOO_FIELDS)
+ *        This defines foo_size (bytes on disk), foo_decode(), foo_encode() and foo_decode_array(),
+ *        foo_encode_array() for tables. On little endian hosts, where the struct is laid out as on
+ *        disk, they are a plain memcpy; on big endian hosts every U32 is swapped.
+ */
+
+#ifndef LECODEC_H
+#define LECODEC_H
+
+#include <string.h>
+
+/* can be set to 0 with -DLECODEC_NATIVE=0 to try the field by field path on a little endian host */
+#ifndef LECODEC_NATIVE
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LECODEC_NATIVE 1
+#else
+#define LECODEC_NATIVE 0
+#endif
+#endif
+
+_Static_assert(sizeof(unsigned int) == 4, "headers hold 32bit unsigned ints");
+
+static inline unsigned int le32_get(const unsigned char *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+}
+
+static inline void le32_put(unsigned char *p, unsigned int v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* what the field table expands to for the struct, its size and the codecs */
+#define LECODEC_FIELD_U32(name) unsigned int name;
+#define LECODEC_FIELD_BYTES(name, n) char name[n];
+#define LECODEC_SIZE_U32(name) + 4
+#define LECODEC_SIZE_BYTES(name, n) + (n)
+#define LECODEC_GET_U32(name) out->name = le32_get(p); p += 4;
+#define LECODEC_GET_BYTES(name, n) memcpy(out->name, p, n); p += (n);
+#define LECODEC_PUT_U32(name) le32_put(p, in->name); p += 4;
+#define LECODEC_PUT_BYTES(name, n) memcpy(p, in->name, n); p += (n);
+
+#define LECODEC_STRUCT(TABLE) TABLE(LECODEC_FIELD_U32, LECODEC_FIELD_BYTES)
+
+/* without padding the struct has the disk layout, so native hosts copy it as a whole */
+#define LECODEC(type, TABLE) \
+enum { type##_size = 0 TABLE(LECODEC_SIZE_U32, LECODEC_SIZE_BYTES) }; \
+\
+static inline void type##_decode(type *out, const unsigned char *p) { \
+	if (LECODEC_NATIVE && sizeof(type) == type##_size) { \
+		memcpy(out, p, sizeof(type)); \
+		return; \
+	} \
+	TABLE(LECODEC_GET_U32, LECODEC_GET_BYTES) \
+} \
+\
+static inline void type##_encode(unsigned char *p, const type *in) { \
+	if (LECODEC_NATIVE && sizeof(type) == type##_size) { \
+		memcpy(p, in, sizeof(type)); \
+		return; \
+	} \
+	TABLE(LECODEC_PUT_U32, LECODEC_PUT_BYTES) \
+} \
+\
+static inline void type##_decode_array(type *out, const unsigned char *p, size_t count) { \
+	if (LECODEC_NATIVE && sizeof(type) == type##_size) { \
+		memcpy(out, p, count * sizeof(type)); \
+		return; \
+	} \
+	for (; count > 0; --count, ++out, p += type##_size) { \
+		type##_decode(out, p); \
+	} \
+} \
+\
+static inline void type##_encode_array(unsigned char *p, const type *in, size_t count) { \
+	if (LECODEC_NATIVE && sizeof(type) == type##_size) { \
+		memcpy(p, in, count * sizeof(type)); \
+		return; \
+	} \
+	for (; count > 0; --count, ++in, p += type##_size) { \
+		type##_encode(p, in); \
+	} \
+}
+
+#endif